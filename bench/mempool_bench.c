@@ -0,0 +1,154 @@
+/*
+ *  Times nmalloc and nfree on their own under the allocation patterns the
+ *  interpreter produces.
+ *
+ *  Usage: mempool_bench [-n operations]
+ *
+ *  Each pattern starts from empty pools and reports the mean time of an
+ *  nmalloc or nfree call, the most chunks alive at once, and how many bytes
+ *  the pools held for them beyond the nvals themselves.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "ncore.h"
+#include "mempool.h"
+
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Deterministic so runs see the same sequence */
+static unsigned long seed = 1;
+
+static unsigned long next_random(void) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return seed >> 33;
+}
+
+/* Chunks alive now and at most, kept here as the pool's own peak spans every pattern */
+static long live = 0;
+static long peak = 0;
+
+static void* alloc(void) {
+    nval* v = nmalloc();
+    if (v == NULL) {
+        fprintf(stderr, "The pools ran out after %ld chunks, try a smaller -n\n", live);
+        exit(1);
+    }
+    v->type = NVAL_NUM;
+    if (++live > peak) { peak = live; }
+    return v;
+}
+
+static void release(void* p) {
+    nfree(p);
+    live--;
+}
+
+/* Push and pop a stack of chunks, as nested evaluation does */
+static long lifo(long ops) {
+    void* stack[64];
+    long done = 0;
+    while (done < ops) {
+        for (int i = 0; i < 64; i++) { stack[i] = alloc(); }
+        for (int i = 63; i >= 0; i--) { release(stack[i]); }
+        done += 128;
+    }
+    return done;
+}
+
+/* A long-lived set, such as definitions, replaced slowly among short-lived temporaries */
+static long mixed(long ops) {
+    long kept = ops / 20 + 1;
+    void** set = malloc(sizeof(void*) * kept);
+    void* temp[8];
+    long done = 0;
+
+    for (long i = 0; i < kept; i++) { set[i] = alloc(); }
+    done += kept;
+    while (done < ops) {
+        for (int i = 0; i < 8; i++) { temp[i] = alloc(); }
+        long r = next_random() % kept;
+        release(set[r]);
+        set[r] = alloc();
+        for (int i = 0; i < 8; i++) { release(temp[i]); }
+        done += 18;
+    }
+    for (long i = 0; i < kept; i++) { release(set[i]); }
+    free(set);
+    return done + kept;
+}
+
+/* Free every other chunk, then churn through the holes left behind */
+static long fragmented(long ops) {
+    long count = ops / 4 + 2;
+    void** chunks = malloc(sizeof(void*) * count);
+    long done = 0;
+
+    for (long i = 0; i < count; i++) { chunks[i] = alloc(); }
+    for (long i = 0; i < count; i += 2) { release(chunks[i]); }
+    done += count + count / 2;
+    while (done < ops) {
+        for (long i = 0; i < count && done < ops; i += 2) {
+            chunks[i] = alloc();
+            done++;
+        }
+        for (long i = 0; i < count; i += 2) {
+            release(chunks[i]);
+            done++;
+        }
+    }
+    for (long i = 1; i < count; i += 2) { release(chunks[i]); }
+    free(chunks);
+    return done + count / 2;
+}
+
+/* Allocate without freeing until many pools exist, as building a large list does */
+static long growth(long ops) {
+    long count = ops / 2;
+    void** chunks = malloc(sizeof(void*) * count);
+    for (long i = 0; i < count; i++) { chunks[i] = alloc(); }
+    for (long i = 0; i < count; i++) { release(chunks[i]); }
+    free(chunks);
+    return count * 2;
+}
+
+static void bench(const char* name, long (*pattern)(long), long ops) {
+    live = 0;
+    peak = 0;
+    seed = 1;
+
+    double start = now_ns();
+    long done = pattern(ops);
+    double ns = (now_ns() - start) / done;
+
+    /* Pools are kept until deallocated, so they show what the peak needed */
+    memory_pool_counts c = pool_counts();
+    long used = peak * sizeof(nval);
+    printf("%-12s %10ld %8.2f %10ld %7d %12ld %9.1f%%\n", name, done, ns, peak, c.pools,
+        c.bytes, 100.0 * (c.bytes - used) / used);
+    deallocate_pools();
+}
+
+int main(int argc, char** argv) {
+    long ops = 4000000;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) { ops = atol(argv[i+1]); }
+    }
+
+    printf("%-12s %10s %8s %10s %7s %12s %10s\n", "pattern", "ops", "ns/op",
+        "peak", "pools", "pool bytes", "overhead");
+    bench("lifo", lifo, ops);
+    bench("mixed", mixed, ops);
+    bench("fragmented", fragmented, ops);
+    bench("growth", growth, ops);
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *  Compares load time of the mpc grammar against the hand-written reader.
+ *
+ *  Usage: read_bench [-i iterations] [-n records] [file...]
+ *
+ *  Each file, plus a generated data file of n records, is read from memory
+ *  by both readers and the mean time per load is reported, along with the
+ *  throughput of each reader and of nval_read alone in millions of nodes
+ *  per second.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "mpc.h"
+#include "ncore.h"
+#include "builtins.h"
+#include "nreader.h"
+#include "mempool.h"
+
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* Nested data records of numbers, strings and symbols, as a data dump would have */
+static char* generate_data(int records, long* len) {
+    long size = 64 * (long)records + 64;
+    char* src = malloc(size);
+    long n = snprintf(src, size, "; generated data\n(def {data} {\n");
+    for (int i = 0; i < records; i++) {
+        n += snprintf(src + n, size - n,
+            "  {\"record-%d\" %d %d.5 sym-%d {1 2 3}}\n", i, i, i, i);
+    }
+    n += snprintf(src + n, size - n, "})\n");
+    *len = n;
+    return src;
+}
+
+static nval* read_mpc(char* name, const char* src, long len) {
+    mpc_result_t r;
+    if (!mpc_parse_nstring(name, src, len, Nitrogen, &r)) {
+        mpc_err_delete(r.error);
+        return NULL;
+    }
+    nval* x = nval_read(r.output);
+    mpc_ast_delete(r.output);
+    return x;
+}
+
+/* Values in a tree, counting lists as well as their elements */
+static long count_nodes(nval* v) {
+    long n = 1;
+    if (v->type == NVAL_SEXPR || v->type == NVAL_QEXPR) {
+        for (int i = 0; i < v->count; i++) { n += count_nodes(v->cell[i]); }
+    }
+    return n;
+}
+
+/* Time to turn an already parsed mpc tree into nvals */
+static double bench_nval_read(char* name, const char* src, long len, int iterations) {
+    mpc_result_t r;
+    if (!mpc_parse_nstring(name, src, len, Nitrogen, &r)) {
+        mpc_err_delete(r.error);
+        return 0;
+    }
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        nval_del(nval_read(r.output));
+    }
+    double ms = (now_ms() - start) / iterations;
+    mpc_ast_delete(r.output);
+    return ms;
+}
+
+static void bench(char* name, const char* src, long len, int iterations) {
+    nval* a = read_mpc(name, src, len);
+    nval* b = nval_read_source(name, src, len);
+    if (a == NULL || b->type == NVAL_ERR) {
+        printf("%-24s could not be read\n", name);
+        if (a) { nval_del(a); }
+        nval_del(b);
+        return;
+    }
+    if (!nval_eq(a, b)) {
+        printf("%-24s readers disagree\n", name);
+    }
+    long nodes = count_nodes(b);
+    nval_del(a);
+    nval_del(b);
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        nval_del(read_mpc(name, src, len));
+    }
+    double mpc = (now_ms() - start) / iterations;
+
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        nval_del(nval_read_source(name, src, len));
+    }
+    double reader = (now_ms() - start) / iterations;
+
+    double convert = bench_nval_read(name, src, len, iterations);
+
+    /* Throughput in millions of nodes per second */
+    printf("%-24s %10ld %9ld %10.3f %10.3f %8.1fx %9.2f %9.2f %9.2f\n", name, len, nodes,
+        mpc, reader, mpc / reader, nodes / mpc / 1e3, nodes / reader / 1e3, nodes / convert / 1e3);
+}
+
+int main(int argc, char** argv) {
+    int iterations = 20;
+    /* Both readers' trees are alive while they are compared, keep inside the nval pools */
+    int records = 400;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        if (i + 1 >= argc) { break; }
+        if (strcmp(argv[i], "-i") == 0) { iterations = atoi(argv[i+1]); }
+        if (strcmp(argv[i], "-n") == 0) { records = atoi(argv[i+1]); }
+    }
+
+    nreader_mpc_init();
+    printf("%-24s %10s %9s %10s %10s %9s %9s %9s %9s\n", "source", "bytes", "nodes",
+        "mpc ms", "reader ms", "speedup", "mpc M/s", "read M/s", "nval M/s");
+
+    for (; i < argc; i++) {
+        nfile f;
+        if (!nfile_open(&f, argv[i])) {
+            printf("%-24s could not be opened\n", argv[i]);
+            continue;
+        }
+        bench(argv[i], f.src, f.len, iterations);
+        nfile_close(&f);
+    }
+
+    long len;
+    char* src = generate_data(records, &len);
+    char name[64];
+    snprintf(name, sizeof(name), "<data %d records>", records);
+    bench(name, src, len, iterations);
+    free(src);
+
+    nreader_mpc_cleanup();
+    deallocate_pools();
+    return 0;
+}
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+#  Runs the Nitrogen benchmark programs and prints one CSV line for each:
+#
+#    benchmark,runs,mean_ms,median_ms,min_ms,max_ms,allocations,frees,peak_chunks,pools
+#
+#  Times and allocation counts come from the interpreter's --stats line, so
+#  they cover the program and not interpreter startup. The load benchmarks
+#  read a generated source file, with and without its .nc image.
+#
+#  Usage: bench/run.sh [-w warmup] [-r runs] [-n nitrogen] [program.n...]
+#
+set -e
+
+warmup=1
+runs=5
+nitrogen=./nitrogen
+while getopts w:r:n: opt; do
+    case $opt in
+        w) warmup=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        n) nitrogen=$OPTARG ;;
+        *) echo "Usage: $0 [-w warmup] [-r runs] [-n nitrogen] [program.n...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/*.n
+    load=1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# bench NAME ARGS... runs the interpreter with ARGS and summarises --stats
+bench() {
+    name=$1
+    shift
+    i=0
+    while [ $i -lt "$warmup" ]; do
+        "$nitrogen" "$@" >/dev/null 2>&1 || true
+        i=$((i + 1))
+    done
+    : > "$tmp/stats"
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$nitrogen" --stats "$@" 2>&1 >/dev/null | grep '^time_ms=' >> "$tmp/stats" || true
+        i=$((i + 1))
+    done
+    if [ ! -s "$tmp/stats" ]; then
+        echo "$name: no results, the program did not run to the end" >&2
+        return
+    fi
+    sort -t= -k2,2n "$tmp/stats" | awk -v name="$name" '
+        {
+            for (f = 1; f <= NF; f++) {
+                split($f, kv, "=")
+                stat[kv[1]] = kv[2]
+            }
+            t[NR] = stat["time_ms"]
+            sum += stat["time_ms"]
+        }
+        END {
+            median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "%s,%d,%.3f,%.3f,%.3f,%.3f,%s,%s,%s,%s\n", name, NR, sum / NR, median,
+                t[1], t[NR], stat["allocations"], stat["frees"], stat["peak_chunks"], stat["pools"]
+        }'
+}
+
+echo "benchmark,runs,mean_ms,median_ms,min_ms,max_ms,allocations,frees,peak_chunks,pools"
+
+for program in "$@"; do
+    bench "$(basename "$program" .n)" "$program"
+done
+
+if [ -n "$load" ]; then
+    awk 'BEGIN {
+        for (i = 0; i < 4000; i++)
+            printf "(def {record-%d} {\"name %d\" %d %d.5 sym-%d {1 2 3}})\n", i, i, i, i, i
+    }' > "$tmp/large.n"
+    bench load-source --no-cache "$tmp/large.n"
+    bench load-image "$tmp/large.n"
+fi
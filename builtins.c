@@ -1,16 +1,39 @@
+#define _POSIX_C_SOURCE 199309L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <math.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "mpc.h"
 #include "builtins.h"
 #include "ncore.h"
 #include "mempool.h"
+#include "narray.h"
+#include "nreader.h"
+#include "nimage.h"
+#include "nprofile.h"
+#include "ntrace.h"
+#include "nperf.h"
+
+/* Pool counts when mem-pool-stats was last called, for rates between calls */
+static long pool_stats_last_ns = 0;
+static long pool_stats_last_allocations = 0;
+static long pool_stats_last_frees = 0;
+
+static long builtin_clock_ns(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
 
 void nenv_add_builtin(nenv* e, char* name, nbuiltin func) {
     nval* k = nval_sym(name);
     nval* v = nval_fun(func);
+    v->name = nprofile_intern(name);
     nenv_put_protected(e, k, v);
     nval_del(k);
     nval_del(v);
@@ -19,12 +42,15 @@ void nenv_add_builtin(nenv* e, char* name, nbuiltin func) {
 void nenv_add_builtin_macro(nenv* e, char* name, nbuiltin func) {
     nval* k = nval_sym(name);
     nval* v = nval_macro(func);
+    v->name = nprofile_intern(name);
     nenv_put_protected(e, k, v);
     nval_del(k);
     nval_del(v);
 }
 
 void nenv_add_builtins(nenv* e) {
+    if (pool_stats_last_ns == 0) { pool_stats_last_ns = builtin_clock_ns(CLOCK_MONOTONIC); }
+
     nenv_add_builtin(e, "load", builtin_load);
     nenv_add_builtin(e, "print", builtin_print);
     nenv_add_builtin(e, "error", builtin_error);
@@ -46,6 +72,21 @@ void nenv_add_builtins(nenv* e) {
 
     nenv_add_builtin(e, "strcat", builtin_strconcat);
     nenv_add_builtin(e, "mem-pool-stats", builtin_pool_stats);
+    nenv_add_builtin(e, "metrics", builtin_metrics);
+
+    /* Timing */
+    nenv_add_builtin(e, "time-ns", builtin_time_ns);
+    nenv_add_builtin(e, "cpu-time-ns", builtin_cpu_time_ns);
+    nenv_add_builtin(e, "bench", builtin_bench);
+    nenv_add_builtin(e, "perf-measure", builtin_perf_measure);
+    nenv_add_builtin(e, "profile-start", builtin_profile_start);
+    nenv_add_builtin(e, "profile-stop", builtin_profile_stop);
+    nenv_add_builtin(e, "profile-report", builtin_profile_report);
+    nenv_add_builtin(e, "trace-start", builtin_trace_start);
+    nenv_add_builtin(e, "trace-stop", builtin_trace_stop);
+    nenv_add_builtin(e, "alloc-profile-start", builtin_alloc_profile_start);
+    nenv_add_builtin(e, "alloc-profile-stop", builtin_alloc_profile_stop);
+    nenv_add_builtin(e, "alloc-profile-report", builtin_alloc_profile_report);
 
     /* Mathematical Functions */
     nenv_add_builtin(e, "+", builtin_add);
@@ -54,6 +95,35 @@ void nenv_add_builtins(nenv* e) {
     nenv_add_builtin(e, "/", builtin_div);
     nenv_add_builtin(e, "%", builtin_modulus);
 
+    /* Packed numeric arrays */
+    nenv_add_builtin(e, "array", builtin_array);
+    nenv_add_builtin(e, "array-list", builtin_array_list);
+    nenv_add_builtin(e, "array-len", builtin_array_len);
+    nenv_add_builtin(e, "array-sum", builtin_array_sum);
+    nenv_add_builtin(e, "array-product", builtin_array_product);
+    nenv_add_builtin(e, "array-min", builtin_array_min);
+    nenv_add_builtin(e, "array-max", builtin_array_max);
+
+    /* Vectors */
+    nenv_add_builtin(e, "vec", builtin_vec);
+    nenv_add_builtin(e, "vec-list", builtin_vec_list);
+    nenv_add_builtin(e, "vec-len", builtin_vec_len);
+    nenv_add_builtin(e, "vec-get", builtin_vec_get);
+    nenv_add_builtin(e, "vec-set!", builtin_vec_set);
+    nenv_add_builtin(e, "vec-push!", builtin_vec_push);
+    nenv_add_builtin(e, "vec-slice", builtin_vec_slice);
+
+    /* Hash maps */
+    nenv_add_builtin(e, "map-new", builtin_map_new);
+    nenv_add_builtin(e, "map-get", builtin_map_get);
+    nenv_add_builtin(e, "map-put", builtin_map_put);
+    nenv_add_builtin(e, "map-del", builtin_map_del);
+    nenv_add_builtin(e, "map-has", builtin_map_has);
+    nenv_add_builtin(e, "map-len", builtin_map_len);
+    nenv_add_builtin(e, "map-keys", builtin_map_keys);
+    nenv_add_builtin(e, "map-vals", builtin_map_vals);
+    nenv_add_builtin(e, "map-items", builtin_map_items);
+
     /* Logical operators */
     nenv_add_builtin(e, "if", builtin_if);
     nenv_add_builtin(e, "==", builtin_eq);
@@ -64,71 +134,626 @@ void nenv_add_builtins(nenv* e) {
     nenv_add_builtin(e, "<=", builtin_le);
 }
 
+/* Memory held outside the pools by the values reachable from an environment.
+ * Vectors and maps are counted once however many copies share them */
+typedef struct builtin_mem_usage {
+    long string_bytes;
+    long cell_bytes;
+    long environments;
+    long bindings;
+    /* nvec and nmap storage already counted, open addressing with a power of two capacity */
+    void** seen;
+    int seen_count;
+    int seen_capacity;
+} builtin_mem_usage;
+
+static unsigned long builtin_usage_hash(void* p) {
+    return ((uintptr_t)p >> 4) * 2654435761UL;
+}
+
+/* Whether shared storage is reached for the first time, remembering it if so */
+static bool builtin_usage_first(builtin_mem_usage* u, void* p) {
+    if ((u->seen_count + 1) * 2 > u->seen_capacity) {
+        int old = u->seen_capacity;
+        void** seen = u->seen;
+        u->seen_capacity = old ? old * 2 : 64;
+        u->seen = calloc(u->seen_capacity, sizeof(void*));
+        for (int i = 0; i < old; i++) {
+            if (seen[i] == NULL) { continue; }
+            unsigned long j = builtin_usage_hash(seen[i]) & (u->seen_capacity - 1);
+            while (u->seen[j]) { j = (j + 1) & (u->seen_capacity - 1); }
+            u->seen[j] = seen[i];
+        }
+        free(seen);
+    }
+
+    unsigned long i = builtin_usage_hash(p) & (u->seen_capacity - 1);
+    while (u->seen[i]) {
+        if (u->seen[i] == p) { return false; }
+        i = (i + 1) & (u->seen_capacity - 1);
+    }
+    u->seen[i] = p;
+    u->seen_count++;
+    return true;
+}
+
+static void builtin_env_usage(nenv* e, builtin_mem_usage* u);
+
+static void builtin_val_usage(nval* v, builtin_mem_usage* u) {
+    switch (v->type) {
+        case NVAL_ERR: u->string_bytes += strlen(v->err) + 1; break;
+        case NVAL_SYM: u->string_bytes += strlen(v->sym) + 1; break;
+        case NVAL_STR: u->string_bytes += strlen(v->str) + 1; break;
+
+        case NVAL_SEXPR:
+        case NVAL_QEXPR:
+            u->cell_bytes += sizeof(nval*) * v->count;
+            for (int i = 0; i < v->count; i++) { builtin_val_usage(v->cell[i], u); }
+        break;
+
+        case NVAL_VEC:
+            if (!builtin_usage_first(u, v->vec)) { break; }
+            u->cell_bytes += sizeof(nval*) * v->vec->capacity;
+            for (int i = 0; i < v->vec->count; i++) { builtin_val_usage(v->vec->items[i], u); }
+        break;
+
+        case NVAL_MAP:
+            if (!builtin_usage_first(u, v->map)) { break; }
+            u->cell_bytes += 2 * sizeof(nval*) * v->map->capacity;
+            for (int i = nval_map_next(v, 0); i != -1; i = nval_map_next(v, i+1)) {
+                builtin_val_usage(v->map->keys[i], u);
+                builtin_val_usage(v->map->vals[i], u);
+            }
+        break;
+
+        case NVAL_FUN:
+            if (!v->builtin) {
+                builtin_val_usage(v->formals, u);
+                builtin_val_usage(v->body, u);
+                builtin_env_usage(v->env, u);
+            }
+        break;
+    }
+}
+
+static void builtin_env_usage(nenv* e, builtin_mem_usage* u) {
+    u->environments++;
+    u->bindings += e->count;
+    u->cell_bytes += (sizeof(char*) + sizeof(nval*) + sizeof(bool)) * e->count;
+    for (int i = 0; i < e->count; i++) {
+        u->string_bytes += strlen(e->syms[i]) + 1;
+        builtin_val_usage(e->vals[i], u);
+    }
+}
+
+static void builtin_stat(nval* m, char* name, nval* x) {
+    nval_map_put(m, nval_str(name), x);
+}
+
+/* Memory pool occupancy, rates since the last call, and memory held by the
+ * global environment, as a map. Rates on the first call are since startup */
 nval* builtin_pool_stats(nenv* e, nval* a) {
-    pool_stats();
+    LASSERT_NUM("mem-pool-stats", a, 0);
     nval_del(a);
-    return nval_empty();
+
+    memory_pool_counts c = pool_counts();
+    nval* m = nval_map();
+    nval* pools = nval_qexpr();
+    long handed_out = 0;
+    for (int i = 0; i < c.pools; i++) {
+        memory_pool_usage u = pool_usage(i);
+        handed_out += u.high_water;
+        nval* p = nval_map();
+        builtin_stat(p, "chunks", nval_num(u.chunks));
+        builtin_stat(p, "used", nval_num(u.used));
+        builtin_stat(p, "high-water", nval_num(u.high_water));
+        builtin_stat(p, "occupancy", nval_double((double)u.used / u.chunks));
+        builtin_stat(p, "fragmentation",
+            nval_double(u.high_water ? (double)(u.high_water - u.used) / u.high_water : 0));
+        pools = nval_add(pools, p);
+    }
+
+    long now = builtin_clock_ns(CLOCK_MONOTONIC);
+    double seconds = (now - pool_stats_last_ns) / 1e9;
+    builtin_stat(m, "pools", pools);
+    builtin_stat(m, "chunk-bytes", nval_num(pool_chunk_size()));
+    builtin_stat(m, "pool-bytes", nval_num(c.bytes));
+    builtin_stat(m, "live", nval_num(c.live));
+    builtin_stat(m, "high-water", nval_num(c.peak));
+    builtin_stat(m, "fragmentation",
+        nval_double(handed_out ? (double)(handed_out - c.live) / handed_out : 0));
+    builtin_stat(m, "allocations", nval_num(c.allocations));
+    builtin_stat(m, "frees", nval_num(c.frees));
+    builtin_stat(m, "allocations-per-sec",
+        nval_double(seconds > 0 ? (c.allocations - pool_stats_last_allocations) / seconds : 0));
+    builtin_stat(m, "frees-per-sec",
+        nval_double(seconds > 0 ? (c.frees - pool_stats_last_frees) / seconds : 0));
+    pool_stats_last_ns = now;
+    pool_stats_last_allocations = c.allocations;
+    pool_stats_last_frees = c.frees;
+
+    /* What the whole program can reach, not just the caller */
+    int depth = 1;
+    nenv* global = e;
+    for (; global->par; global = global->par) { depth++; }
+    builtin_mem_usage u = { 0, 0, 0, 0, NULL, 0, 0 };
+    builtin_env_usage(global, &u);
+    free(u.seen);
+    builtin_stat(m, "string-bytes", nval_num(u.string_bytes));
+    builtin_stat(m, "cell-bytes", nval_num(u.cell_bytes));
+    builtin_stat(m, "environments", nval_num(u.environments));
+    builtin_stat(m, "bindings", nval_num(u.bindings));
+    builtin_stat(m, "global-bindings", nval_num(global->count));
+    builtin_stat(m, "scope-depth", nval_num(depth));
+    return m;
 }
 
-nval* builtin_load(nenv* e, nval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, NVAL_STR);
+/* Evaluator and memory pool counters since startup */
+nval* builtin_metrics(nenv* e, nval* a) {
+    LASSERT_NUM("metrics", a, 0);
+    nval_del(a);
+    return nval_metrics_map();
+}
 
-  /* Parse File given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Nitrogen, &r)) {
-
-    /* Read contents */
-    nval* expr = nval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    /* Evaluate each Expression */
-    while (expr->count) {
-        nval* x = nval_eval(e, nval_pop(expr, 0));
-        /* If Evaluation leads to error print it */
-        if (x->type == NVAL_ERR) { nval_println(x); }
-        /* Special case for NVAL_QUIT type */
-        if (x->type == NVAL_QUIT) { nval_del(x); break; }
+/* Nanoseconds on a clock that only goes forward, for measuring intervals */
+nval* builtin_time_ns(nenv* e, nval* a) {
+    LASSERT_NUM("time-ns", a, 0);
+    nval_del(a);
+    return nval_num(builtin_clock_ns(CLOCK_MONOTONIC));
+}
+
+/* Nanoseconds of CPU time used by the interpreter */
+nval* builtin_cpu_time_ns(nenv* e, nval* a) {
+    LASSERT_NUM("cpu-time-ns", a, 0);
+    nval_del(a);
+    return nval_num(builtin_clock_ns(CLOCK_PROCESS_CPUTIME_ID));
+}
+
+/* Most iterations bench times, which keeps a long for each */
+#define BUILTIN_BENCH_MAX 100000000L
+
+static int builtin_bench_order(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Evaluate code iterations times after warmup untimed runs, returning a map of
+ * time statistics in nanoseconds and the mean pool allocations per iteration */
+nval* builtin_bench(nenv* e, nval* a) {
+    LASSERT_MIN_ARGS("bench", a, 2);
+    LASSERT(a, a->count <= 3,
+        "Function 'bench' passed incorrect number of arguments. Got %i, Expected at most %i.",
+        a->count, 3);
+    LASSERT_TYPE("bench", a, 0, NVAL_QEXPR);
+    LASSERT_TYPE("bench", a, 1, NVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0, "Function 'bench' needs at least 1 iteration");
+    /* Every time is kept, and the p99 index is computed from iterations * 99 */
+    LASSERT(a, a->cell[1]->num <= BUILTIN_BENCH_MAX,
+        "Function 'bench' cannot time more than %li iterations", (long)BUILTIN_BENCH_MAX);
+    if (a->count == 3) {
+        LASSERT_TYPE("bench", a, 2, NVAL_NUM);
+        LASSERT(a, a->cell[2]->num >= 0, "Function 'bench' passed a negative warmup");
+    }
+
+    nval* code = a->cell[0];
+    long iterations = a->cell[1]->num;
+    long warmup = a->count == 3 ? a->cell[2]->num : 0;
+    long* times = malloc(sizeof(long) * iterations);
+    LASSERT(a, times, "Function 'bench' cannot time %li iterations", iterations);
+
+    /* Only the evaluation is timed and counted, not copying the code for it */
+    long allocations = 0;
+    for (long i = -warmup; i < iterations; i++) {
+        nval* args = nval_add(nval_sexpr(), nval_copy(code));
+        memory_pool_counts before = pool_counts();
+        long start = builtin_clock_ns(CLOCK_MONOTONIC);
+        nval* x = builtin_eval(e, args);
+        long end = builtin_clock_ns(CLOCK_MONOTONIC);
+        memory_pool_counts after = pool_counts();
+
+        if (x->type == NVAL_ERR || x->type == NVAL_QUIT) {
+            free(times);
+            nval_del(a);
+            return x;
+        }
         nval_del(x);
+        if (i >= 0) {
+            times[i] = end - start;
+            allocations += after.allocations - before.allocations;
+        }
+    }
+    nval_del(a);
+
+    long total = 0;
+    for (long i = 0; i < iterations; i++) { total += times[i]; }
+    qsort(times, iterations, sizeof(long), builtin_bench_order);
+
+    nval* m = nval_map();
+    nval_map_put(m, nval_str("iterations"), nval_num(iterations));
+    nval_map_put(m, nval_str("mean-ns"), nval_double((double)total / iterations));
+    nval_map_put(m, nval_str("median-ns"), nval_num(times[iterations / 2]));
+    nval_map_put(m, nval_str("p99-ns"), nval_num(times[(iterations * 99 - 1) / 100]));
+    nval_map_put(m, nval_str("min-ns"), nval_num(times[0]));
+    nval_map_put(m, nval_str("max-ns"), nval_num(times[iterations - 1]));
+    nval_map_put(m, nval_str("allocations"),
+        nval_double((double)allocations / iterations));
+    free(times);
+    return m;
+}
+
+/* Evaluate code and return a map of its value, the time it took and the
+ * hardware counters the system offers, with instructions per cycle when it can */
+nval* builtin_perf_measure(nenv* e, nval* a) {
+    LASSERT_NUM("perf-measure", a, 1);
+    LASSERT_TYPE("perf-measure", a, 0, NVAL_QEXPR);
+
+    nperf_counts c;
+    nperf_begin(&c);
+    nval* x = builtin_eval(e, a);
+    nperf_end(&c);
+    if (x->type == NVAL_ERR || x->type == NVAL_QUIT) { return x; }
+
+    nval* m = nval_map();
+    nval_map_put(m, nval_str("value"), x);
+    nval_map_put(m, nval_str("time-ns"), nval_num(c.time_ns));
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        if (c.available[i]) {
+            nval_map_put(m, nval_str((char*)nperf_name(i)), nval_num(c.values[i]));
+        }
+    }
+    if (c.available[NPERF_CYCLES] && c.available[NPERF_INSTRUCTIONS] && c.values[NPERF_CYCLES] > 0) {
+        nval_map_put(m, nval_str("ipc"),
+            nval_double((double)c.values[NPERF_INSTRUCTIONS] / c.values[NPERF_CYCLES]));
+    }
+    return m;
+}
+
+bool builtin_write_file(char* path, nwriter write) {
+    if (path == NULL) { return write(stdout); }
+
+    FILE* out = fopen(path, "w");
+    if (out == NULL) { return false; }
+    bool ok = write(out);
+    return fclose(out) == 0 && ok;
+}
+
+/* Write to the file named by the optional argument, or print, returning an
+ * error naming what was being written if that fails */
+static nval* builtin_write_arg(nval* a, char* what, nwriter write) {
+    char* path = a->count > 0 ? a->cell[0]->str : NULL;
+    nval* x = builtin_write_file(path, write) ? nval_empty()
+        : path ? nval_err("Could not write %s %s", what, path) : nval_err("Could not write %s", what);
+    nval_del(a);
+    return x;
+}
+
+/* Sample the call stack, every given number of microseconds of CPU time or every millisecond */
+nval* builtin_profile_start(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("profile-start", a, 1);
+        LASSERT_TYPE("profile-start", a, 0, NVAL_NUM);
+        LASSERT(a, a->cell[0]->num > 0, "Function 'profile-start' needs an interval above 0");
     }
+    LASSERT(a, !nprofile_running(), "Profiler is already running");
 
-    /* Delete expressions and arguments */
-    nval_del(expr);
+    long interval = a->count > 0 ? a->cell[0]->num : 1000;
     nval_del(a);
+    if (!nprofile_start(interval)) {
+        return nval_err("Could not start the profiler");
+    }
+    return nval_empty();
+}
 
-    /* Return empty list */
-    return nval_ok();
+/* Stop sampling and write folded stacks to the given file, or print them */
+nval* builtin_profile_stop(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("profile-stop", a, 1);
+        LASSERT_TYPE("profile-stop", a, 0, NVAL_STR);
+    }
+    LASSERT(a, nprofile_running(), "Profiler is not running");
+    return builtin_write_arg(a, "profile", nprofile_stop);
+}
 
-  } else {
-    /* Get Parse Error as String */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+/* Table on stdout, CSV in files */
+static bool builtin_profile_report_write(FILE* out) {
+    return nprofile_report(out, out != stdout);
+}
+
+/* Print call counts and times as a table, or write them to the given file as CSV */
+nval* builtin_profile_report(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("profile-report", a, 1);
+        LASSERT_TYPE("profile-report", a, 0, NVAL_STR);
+    }
+    return builtin_write_arg(a, "profile report", builtin_profile_report_write);
+}
+
+/* Record calls, loads and top-level forms, keeping the given number of newest events */
+nval* builtin_trace_start(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("trace-start", a, 1);
+        LASSERT_TYPE("trace-start", a, 0, NVAL_NUM);
+        LASSERT(a, a->cell[0]->num > 0, "Function 'trace-start' needs a size above 0");
+    }
+    LASSERT(a, !ntrace_on, "Tracing is already on");
 
-    /* Create new error message using it */
-    nval* err = nval_err("Could not load Library %s", err_msg);
-    free(err_msg);
+    long events = a->count > 0 ? a->cell[0]->num : 1 << 18;
     nval_del(a);
+    if (!ntrace_start(events)) {
+        return nval_err("Could not start tracing");
+    }
+    return nval_empty();
+}
 
-    /* Cleanup and return error */
-    return err;
+/* Stop tracing and write the trace to the given file as Chrome trace-event JSON, or print it */
+nval* builtin_trace_stop(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("trace-stop", a, 1);
+        LASSERT_TYPE("trace-stop", a, 0, NVAL_STR);
+    }
+    LASSERT(a, ntrace_on, "Tracing is not on");
+    ntrace_stop();
+    return builtin_write_arg(a, "trace", ntrace_write);
+}
+
+/* Count allocations against the function making them, forgetting any counted before */
+nval* builtin_alloc_profile_start(nenv* e, nval* a) {
+    LASSERT_NUM("alloc-profile-start", a, 0);
+    nval_del(a);
+    pool_profile_start();
+    return nval_empty();
+}
+
+nval* builtin_alloc_profile_stop(nenv* e, nval* a) {
+    LASSERT_NUM("alloc-profile-stop", a, 0);
+    nval_del(a);
+    pool_profile_stop();
+    return nval_empty();
+}
+
+bool builtin_alloc_profile_write(FILE* out) {
+    return pool_profile_report(out, out != stdout);
+}
+
+/* Print allocations by function as a table, or write them to the given file as CSV */
+nval* builtin_alloc_profile_report(nenv* e, nval* a) {
+    if (a->count > 0) {
+        LASSERT_NUM("alloc-profile-report", a, 1);
+        LASSERT_TYPE("alloc-profile-report", a, 0, NVAL_STR);
+    }
+    return builtin_write_arg(a, "allocation report", builtin_alloc_profile_write);
+}
+
+/* Read every expression in a file with the selected reader */
+static nval* builtin_load_read(char* filename) {
+  nfile f;
+  if (!nfile_open(&f, filename)) {
+    return nval_err("Could not load Library %s: error: Unable to open file!", filename);
+  }
+
+  /* A fresh image of the file saves reading it again */
+  bool cache = nimage_cache && f.mapped && !nreader_use_mpc;
+  uint64_t hash = cache ? nimage_hash(f.src, f.len) : 0;
+  nval* expr = cache ? nimage_load_module(filename, f.len, hash) : NULL;
+  if (expr) {
+    nfile_close(&f);
+    return expr;
+  }
+
+  if (nreader_use_mpc) {
+    mpc_result_t r;
+    if (mpc_parse_nstring(filename, f.src, f.len, Nitrogen, &r)) {
+      expr = nval_read(r.output);
+      mpc_ast_delete(r.output);
+    } else {
+      /* Get Parse Error as String */
+      char* err_msg = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+
+      /* Create new error message using it */
+      expr = nval_err("Could not load Library %s", err_msg);
+      free(err_msg);
+    }
+  } else {
+    expr = nval_read_source(filename, f.src, f.len);
+    if (expr->type == NVAL_ERR) {
+      nval* err = nval_err("Could not load Library %s", expr->err);
+      nval_del(expr);
+      expr = err;
+    } else if (cache) {
+      nimage_save_module(filename, f.len, hash, expr);
+    }
+  }
+
+  nfile_close(&f);
+  return expr;
+}
+
+/* Evaluate one expression read from a file. False once it asks to quit */
+static bool builtin_load_eval(nenv* e, nval* x) {
+  /* Traced under the name of the function the form calls */
+  char* form = NULL;
+  if (ntrace_on) {
+    bool named = x->type == NVAL_SEXPR && x->count > 0 && x->cell[0]->type == NVAL_SYM;
+    form = named ? nprofile_intern(x->cell[0]->sym) : "form";
+    ntrace_begin(NTRACE_FORM, form);
+  }
+
+  x = nval_eval(e, x);
+  if (form && ntrace_on) { ntrace_end(NTRACE_FORM, form); }
+
+  /* If Evaluation leads to error print it */
+  if (x->type == NVAL_ERR) { nval_println(x); }
+  /* Special case for NVAL_QUIT type */
+  bool quit = x->type == NVAL_QUIT;
+  nval_del(x);
+  return !quit;
+}
+
+/* Read and evaluate one expression at a time, so only the expression
+ * being evaluated is held in memory whatever the size of the file */
+static nval* builtin_load_stream(nenv* e, char* filename) {
+  nfile f;
+  FILE* fp = NULL;
+  nreader r;
+
+  if (nfile_map(&f, filename)) {
+    nreader_open(&r, filename, f.src, f.len);
+  } else {
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+      return nval_err("Could not load Library %s: error: Unable to open file!", filename);
+    }
+    nreader_open_stream(&r, filename);
+  }
+
+  char chunk[65536];
+  nval* result = nval_ok();
+  while (1) {
+    nval* x = nreader_next(&r);
+
+    if (x == NULL) {
+      /* Out of text, refill from the file unless it is all read */
+      if (fp == NULL || r.eof) { break; }
+      long n = fread(chunk, 1, sizeof(chunk), fp);
+      if (n > 0) { nreader_feed(&r, chunk, n); }
+      if (n < (long)sizeof(chunk)) { nreader_finish(&r); }
+      continue;
+    }
+
+    if (r.failed) {
+      nval_del(result);
+      result = nval_err("Could not load Library %s", x->err);
+      nval_del(x);
+      break;
+    }
+    if (!builtin_load_eval(e, x)) { break; }
+
+    /* Pages already read from a mapped file are not needed again */
+    if (fp == NULL && r.pos - f.released >= (1 << 20)) { nfile_release(&f, r.pos); }
+  }
+
+  nreader_close(&r);
+  if (fp) { fclose(fp); } else { nfile_close(&f); }
+  return result;
+}
+
+/* One line of key=value pairs on stderr for each file loaded with --perf */
+static void builtin_load_perf(char* filename, nperf_counts* c) {
+  static bool warned = false;
+  if (nperf_unavailable() && !warned) {
+    fprintf(stderr, "Hardware counters are unavailable: %s\n", nperf_unavailable());
+    warned = true;
+  }
+
+  fprintf(stderr, "perf file=%s time_ms=%.3f", filename, c->time_ns / 1e6);
+  for (int i = 0; i < NPERF_COUNTERS; i++) {
+    if (c->available[i]) { fprintf(stderr, " %s=%lld", nperf_name(i), c->values[i]); }
+  }
+  fputc('\n', stderr);
+}
+
+static nval* builtin_load_file(nenv* e, char* filename) {
+  if (nreader_stream && !nreader_use_mpc) {
+    return builtin_load_stream(e, filename);
+  }
+
+  /* Parse File given by string name */
+  nval* expr = builtin_load_read(filename);
+  if (expr->type == NVAL_ERR) {
+    return expr;
+  }
+
+  return builtin_load_forms(e, expr);
+}
+
+nval* builtin_load(nenv* e, nval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, NVAL_STR);
+
+  char* file = ntrace_on ? nprofile_intern(a->cell[0]->str) : NULL;
+  if (file) { ntrace_begin(NTRACE_LOAD, file); }
+  nperf_counts counts;
+  if (nperf_loads) { nperf_begin(&counts); }
+
+  /* An image dumped later is only good while this file is unchanged */
+  if (nimage_sources) { nimage_source(a->cell[0]->str); }
+  nval* x = builtin_load_file(e, a->cell[0]->str);
+
+  if (nperf_loads) {
+    nperf_end(&counts);
+    builtin_load_perf(a->cell[0]->str, &counts);
   }
+  nval_del(a);
+
+  if (file && ntrace_on) { ntrace_end(NTRACE_LOAD, file); }
+  return x;
+}
+
+/* Evaluate each form read from a file, then delete them */
+nval* builtin_load_forms(nenv* e, nval* forms) {
+  while (forms->count) {
+      if (!builtin_load_eval(e, nval_pop(forms, 0))) { break; }
+  }
+
+  nval_del(forms);
+  return nval_ok();
 }
 
 /* Builtin arithmatic operations */
-nval* builtin_op(nenv* e, nval* a, char* op) {
-    LASSERT_MIN_ARGS(op, a, 2);
-    bool is_double = false;
+static nval* builtin_op_num(nval* a, char* op) {
+    nval* x = nval_pop(a, 0);
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == NVAL_NUM || a->cell[i]->type == NVAL_DOUBLE,
-            "Function '%s' was passed incorrect type", op);
+    if ((strcmp(op, "-") == 0) && a->count == 0) {
+        if (x->num == LONG_MIN) {
+            nval_del(x);
+            nval_del(a);
+            return nval_err("Integer overflow in '%s'", op);
+        }
+        x->num = -x->num;
+    }
 
-        if (a->cell[i]->type == NVAL_DOUBLE) {
-            is_double = true;
-            break;
+    while (a->count > 0) {
+        nval* y = nval_pop(a, 0);
+        bool overflow = false;
+
+        switch (op[0]) {
+            case '+': overflow = __builtin_add_overflow(x->num, y->num, &x->num); break;
+            case '-': overflow = __builtin_sub_overflow(x->num, y->num, &x->num); break;
+            case '*': overflow = __builtin_mul_overflow(x->num, y->num, &x->num); break;
+            case '/':
+            case '%':
+                if (y->num == 0) {
+                    nval_del(x);
+                    nval_del(y);
+                    nval_del(a);
+                    return nval_err("Division By Zero!");
+                }
+                /* LONG_MIN / -1 is the only quotient that does not fit */
+                if (x->num == LONG_MIN && y->num == -1) {
+                    if (op[0] == '/') { overflow = true; }
+                    else { x->num = 0; }
+                    break;
+                }
+                if (op[0] == '/') { x->num /= y->num; }
+                else { x->num %= y->num; }
+                break;
+        }
+        nval_del(y);
+
+        if (overflow) {
+            nval_del(x);
+            nval_del(a);
+            return nval_err("Integer overflow in '%s'", op);
         }
     }
 
+    nval_del(a);
+    return x;
+}
+
+static nval* builtin_op_double(nval* a, char* op) {
     /* Convert numbers to double for operation */
     for (int i = 0; i < a->count; i++) {
         if (a->cell[i]->type == NVAL_NUM) {
@@ -145,38 +770,146 @@ nval* builtin_op(nenv* e, nval* a, char* op) {
     while (a->count > 0) {
         nval* y = nval_pop(a, 0);
 
-        if (strcmp(op, "+") == 0) { x->doub += y->doub; }
-        if (strcmp(op, "-") == 0) { x->doub -= y->doub; }
-        if (strcmp(op, "*") == 0) { x->doub *= y->doub; }
-        if (strcmp(op, "/") == 0) {
-            if (y->doub == 0) {
-                nval_del(x);
-                nval_del(y);
-                x = nval_err("Division By Zero!"); break;
-            }
-            x->doub /= y->doub;
-        }
-        if (strcmp(op, "%") == 0) {
-            if (y->doub == 0) {
-                nval_del(x);
-                nval_del(y);
-                x = nval_err("Division By Zero!"); break;
-            }
-            x->doub = fmod(x->doub, y->doub);
+        switch (op[0]) {
+            case '+': x->doub += y->doub; break;
+            case '-': x->doub -= y->doub; break;
+            case '*': x->doub *= y->doub; break;
+            case '/':
+            case '%':
+                if (y->doub == 0) {
+                    nval_del(x);
+                    nval_del(y);
+                    nval_del(a);
+                    return nval_err("Division By Zero!");
+                }
+                if (op[0] == '/') { x->doub /= y->doub; }
+                else { x->doub = fmod(x->doub, y->doub); }
+                break;
         }
-
         nval_del(y);
     }
 
-    /* If none of the inputs were double, reconvert to NVAL_NUM */
-    if (!is_double) {
-        x->num = x->doub;
-        x->type = NVAL_NUM;
+    nval_del(a);
+    return x;
+}
+
+/* Length shared by all array arguments, or -1 if they differ */
+static int nval_array_args_len(nval* a) {
+    int n = -1;
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type != NVAL_ARRAY) { continue; }
+        if (n != -1 && a->cell[i]->count != n) { return -2; }
+        n = a->cell[i]->count;
+    }
+    return n;
+}
+
+static bool nval_array_args_double(nval* a) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type == NVAL_DOUBLE) { return true; }
+        if (a->cell[i]->type == NVAL_ARRAY && a->cell[i]->arr_type == NVAL_DOUBLE) { return true; }
+    }
+    return false;
+}
+
+/* Write a number or array argument into buf as n longs, broadcasting numbers */
+static void nval_array_fill_long(nval* v, long* buf, int n) {
+    if (v->type == NVAL_ARRAY) {
+        memcpy(buf, v->nums, sizeof(long) * n);
+    } else {
+        for (int i = 0; i < n; i++) { buf[i] = v->num; }
+    }
+}
+
+/* Write a number or array argument into buf as n doubles, broadcasting numbers */
+static void nval_array_fill_double(nval* v, double* buf, int n) {
+    if (v->type == NVAL_ARRAY && v->arr_type == NVAL_DOUBLE) {
+        memcpy(buf, v->doubs, sizeof(double) * n);
+    } else if (v->type == NVAL_ARRAY) {
+        for (int i = 0; i < n; i++) { buf[i] = v->nums[i]; }
+    } else {
+        double d = (v->type == NVAL_DOUBLE) ? v->doub : v->num;
+        for (int i = 0; i < n; i++) { buf[i] = d; }
+    }
+}
+
+/* Element-wise arithmatic when at least one argument is an array */
+static nval* builtin_op_array(nval* a, char* op) {
+    int n = nval_array_args_len(a);
+    LASSERT(a, n >= 0, "Function '%s' passed arrays of different lengths", op);
+
+    bool is_double = nval_array_args_double(a);
+    nval* x = nval_array(is_double ? NVAL_DOUBLE : NVAL_NUM, n);
+    void* y = malloc((is_double ? sizeof(double) : sizeof(long)) * (n ? n : 1));
+    int status = NARRAY_OK;
+
+    if (is_double) {
+        nval_array_fill_double(a->cell[0], x->doubs, n);
+    } else {
+        nval_array_fill_long(a->cell[0], x->nums, n);
+    }
+
+    /* Negate a single array as 0 - x, which also catches overflow */
+    if (op[0] == '-' && a->count == 1) {
+        memset(y, 0, (is_double ? sizeof(double) : sizeof(long)) * n);
+        if (is_double) {
+            status = narray_op_double(op[0], x->doubs, y, x->doubs, n);
+        } else {
+            status = narray_op_long(op[0], x->nums, y, x->nums, n);
+        }
     }
+
+    for (int i = 1; i < a->count && status == NARRAY_OK; i++) {
+        if (is_double) {
+            nval_array_fill_double(a->cell[i], y, n);
+            status = narray_op_double(op[0], x->doubs, x->doubs, y, n);
+        } else {
+            nval_array_fill_long(a->cell[i], y, n);
+            status = narray_op_long(op[0], x->nums, x->nums, y, n);
+        }
+    }
+    free(y);
     nval_del(a);
+
+    if (status != NARRAY_OK) {
+        nval_del(x);
+        if (status == NARRAY_DIV_ZERO) { return nval_err("Division By Zero!"); }
+        return nval_err("Integer overflow in '%s'", op);
+    }
     return x;
 }
 
+nval* builtin_op(nenv* e, nval* a, char* op) {
+    /* A single argument to '-' is negated */
+    int min_args = strcmp(op, "-") == 0 ? 1 : 2;
+    LASSERT_MIN_ARGS(op, a, min_args);
+    bool is_double = false;
+    bool is_array = false;
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == NVAL_NUM || a->cell[i]->type == NVAL_DOUBLE
+            || a->cell[i]->type == NVAL_ARRAY,
+            "Function '%s' was passed incorrect type", op);
+
+        if (a->cell[i]->type == NVAL_DOUBLE) {
+            is_double = true;
+        }
+        if (a->cell[i]->type == NVAL_ARRAY) {
+            is_array = true;
+        }
+    }
+
+    if (is_array) {
+        return builtin_op_array(a, op);
+    }
+
+    /* Integers stay integers so longs above 2^53 keep their precision */
+    if (!is_double) {
+        return builtin_op_num(a, op);
+    }
+    return builtin_op_double(a, op);
+}
+
 nval* builtin_add(nenv* e, nval* a) {
     return builtin_op(e, a, "+");
 }
@@ -197,6 +930,332 @@ nval* builtin_modulus(nenv* e, nval* a) {
     return builtin_op(e, a, "%");
 }
 
+/* Build a packed array from numbers given as arguments or in one Q-Expression */
+nval* builtin_array(nenv* e, nval* a) {
+    if (a->count == 1 && a->cell[0]->type == NVAL_QEXPR) {
+        a = nval_take(a, 0);
+    }
+
+    bool is_double = false;
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == NVAL_NUM || a->cell[i]->type == NVAL_DOUBLE,
+            "Function 'array' passed incorrect type. Got %s, Expected %s.",
+            ntype_name(a->cell[i]->type), ntype_name(NVAL_NUM));
+
+        if (a->cell[i]->type == NVAL_DOUBLE) {
+            is_double = true;
+        }
+    }
+
+    nval* x = nval_array(is_double ? NVAL_DOUBLE : NVAL_NUM, a->count);
+    for (int i = 0; i < a->count; i++) {
+        if (!is_double) {
+            x->nums[i] = a->cell[i]->num;
+        } else if (a->cell[i]->type == NVAL_DOUBLE) {
+            x->doubs[i] = a->cell[i]->doub;
+        } else {
+            x->doubs[i] = a->cell[i]->num;
+        }
+    }
+    nval_del(a);
+    return x;
+}
+
+/* Convert a packed array back into a Q-Expression */
+nval* builtin_array_list(nenv* e, nval* a) {
+    LASSERT_NUM("array-list", a, 1);
+    LASSERT_TYPE("array-list", a, 0, NVAL_ARRAY);
+
+    nval* v = a->cell[0];
+    nval* x = nval_qexpr();
+    for (int i = 0; i < v->count; i++) {
+        if (v->arr_type == NVAL_DOUBLE) {
+            x = nval_add(x, nval_double(v->doubs[i]));
+        } else {
+            x = nval_add(x, nval_num(v->nums[i]));
+        }
+    }
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_array_len(nenv* e, nval* a) {
+    LASSERT_NUM("array-len", a, 1);
+    LASSERT_TYPE("array-len", a, 0, NVAL_ARRAY);
+
+    nval* x = nval_num(a->cell[0]->count);
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_array_reduce(nenv* e, nval* a, char op, char* func) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, NVAL_ARRAY);
+    if (op == '<' || op == '>') {
+        LASSERT(a, a->cell[0]->count != 0, "Function '%s' passed empty array", func);
+    }
+
+    nval* v = a->cell[0];
+    nval* x;
+    if (v->arr_type == NVAL_DOUBLE) {
+        x = nval_double(0);
+        narray_reduce_double(op, v->doubs, v->count, &x->doub);
+    } else {
+        x = nval_num(0);
+        if (narray_reduce_long(op, v->nums, v->count, &x->num) != NARRAY_OK) {
+            nval_del(x);
+            x = nval_err("Integer overflow in '%s'", func);
+        }
+    }
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_array_sum(nenv* e, nval* a) {
+    return builtin_array_reduce(e, a, '+', "array-sum");
+}
+
+nval* builtin_array_product(nenv* e, nval* a) {
+    return builtin_array_reduce(e, a, '*', "array-product");
+}
+
+nval* builtin_array_min(nenv* e, nval* a) {
+    return builtin_array_reduce(e, a, '<', "array-min");
+}
+
+nval* builtin_array_max(nenv* e, nval* a) {
+    return builtin_array_reduce(e, a, '>', "array-max");
+}
+
+/* Build a vector from the given arguments */
+nval* builtin_vec(nenv* e, nval* a) {
+    nval* v = nval_vec();
+    while (a->count) {
+        nval_vec_push(v, nval_pop(a, 0));
+    }
+    nval_del(a);
+    return v;
+}
+
+/* Convert a vector into a Q-Expression */
+nval* builtin_vec_list(nenv* e, nval* a) {
+    LASSERT_NUM("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, NVAL_VEC);
+
+    nval* x = nval_qexpr();
+    for (int i = 0; i < nval_vec_len(a->cell[0]); i++) {
+        x = nval_add(x, nval_copy(nval_vec_items(a->cell[0])[i]));
+    }
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_vec_len(nenv* e, nval* a) {
+    LASSERT_NUM("vec-len", a, 1);
+    LASSERT_TYPE("vec-len", a, 0, NVAL_VEC);
+
+    nval* x = nval_num(nval_vec_len(a->cell[0]));
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_vec_get(nenv* e, nval* a) {
+    LASSERT_NUM("vec-get", a, 2);
+    LASSERT_TYPE("vec-get", a, 0, NVAL_VEC);
+    LASSERT_TYPE("vec-get", a, 1, NVAL_NUM);
+
+    long i = a->cell[1]->num;
+    LASSERT(a, i >= 0 && i < nval_vec_len(a->cell[0]),
+        "Function 'vec-get' index %li out of range for vector of length %i",
+        i, nval_vec_len(a->cell[0]));
+
+    nval* x = nval_copy(nval_vec_items(a->cell[0])[i]);
+    nval_del(a);
+    return x;
+}
+
+/* Replace an element in place and return the vector */
+nval* builtin_vec_set(nenv* e, nval* a) {
+    LASSERT_NUM("vec-set!", a, 3);
+    LASSERT_TYPE("vec-set!", a, 0, NVAL_VEC);
+    LASSERT_TYPE("vec-set!", a, 1, NVAL_NUM);
+
+    long i = a->cell[1]->num;
+    LASSERT(a, i >= 0 && i < nval_vec_len(a->cell[0]),
+        "Function 'vec-set!' index %li out of range for vector of length %i",
+        i, nval_vec_len(a->cell[0]));
+
+    LASSERT(a, !nval_reaches(a->cell[2], a->cell[0]->vec),
+        "Function 'vec-set!' cannot store a vector inside itself");
+
+    nval* v = nval_pop(a, 0);
+    nval* x = nval_pop(a, 1);
+    nval_del(nval_vec_items(v)[i]);
+    nval_vec_items(v)[i] = x;
+    nval_del(a);
+    return v;
+}
+
+/* Append an element in place and return the vector */
+nval* builtin_vec_push(nenv* e, nval* a) {
+    LASSERT_NUM("vec-push!", a, 2);
+    LASSERT_TYPE("vec-push!", a, 0, NVAL_VEC);
+    LASSERT(a, a->cell[0]->vec_end == -1,
+        "Function 'vec-push!' cannot grow a vector slice");
+    LASSERT(a, !nval_reaches(a->cell[1], a->cell[0]->vec),
+        "Function 'vec-push!' cannot store a vector inside itself");
+
+    nval* v = nval_pop(a, 0);
+    nval_vec_push(v, nval_pop(a, 0));
+    nval_del(a);
+    return v;
+}
+
+/* View of elements [start, end) sharing storage with the original vector */
+nval* builtin_vec_slice(nenv* e, nval* a) {
+    LASSERT_NUM("vec-slice", a, 3);
+    LASSERT_TYPE("vec-slice", a, 0, NVAL_VEC);
+    LASSERT_TYPE("vec-slice", a, 1, NVAL_NUM);
+    LASSERT_TYPE("vec-slice", a, 2, NVAL_NUM);
+
+    long start = a->cell[1]->num;
+    long end = a->cell[2]->num;
+    LASSERT(a, start >= 0 && start <= end && end <= nval_vec_len(a->cell[0]),
+        "Function 'vec-slice' range %li to %li out of range for vector of length %i",
+        start, end, nval_vec_len(a->cell[0]));
+
+    nval* v = nval_pop(a, 0);
+    v->vec_end = v->vec_start + end;
+    v->vec_start += start;
+    nval_del(a);
+    return v;
+}
+
+#define LASSERT_MAP_KEY(func, args, index) \
+    LASSERT(args, nval_map_key_ok(args->cell[index]), \
+        "Function '%s' passed incorrect key type. Got %s, Expected %s, %s or %s.", \
+        func, ntype_name(args->cell[index]->type), ntype_name(NVAL_NUM), \
+        ntype_name(NVAL_SYM), ntype_name(NVAL_STR))
+
+/* Build a map from alternating keys and values */
+nval* builtin_map_new(nenv* e, nval* a) {
+    LASSERT(a, a->count % 2 == 0,
+        "Function 'map-new' passed a key without a value");
+    for (int i = 0; i < a->count; i += 2) {
+        LASSERT_MAP_KEY("map-new", a, i);
+    }
+
+    nval* m = nval_map();
+    while (a->count) {
+        nval* k = nval_pop(a, 0);
+        nval_map_put(m, k, nval_pop(a, 0));
+    }
+    nval_del(a);
+    return m;
+}
+
+/* Value for a key, or the optional default if the key is absent */
+nval* builtin_map_get(nenv* e, nval* a) {
+    LASSERT_MIN_ARGS("map-get", a, 2);
+    LASSERT(a, a->count <= 3,
+        "Function 'map-get' passed incorrect number of arguments. Got %i, Expected at most %i.",
+        a->count, 3);
+    LASSERT_TYPE("map-get", a, 0, NVAL_MAP);
+    LASSERT_MAP_KEY("map-get", a, 1);
+
+    nval* v = nval_map_get(a->cell[0], a->cell[1]);
+    if (v) {
+        v = nval_copy(v);
+    } else if (a->count == 3) {
+        v = nval_pop(a, 2);
+    } else {
+        v = nval_err("Function 'map-get' key not found");
+    }
+    nval_del(a);
+    return v;
+}
+
+/* Store a value in place and return the map */
+nval* builtin_map_put(nenv* e, nval* a) {
+    LASSERT_NUM("map-put", a, 3);
+    LASSERT_TYPE("map-put", a, 0, NVAL_MAP);
+    LASSERT_MAP_KEY("map-put", a, 1);
+    LASSERT(a, !nval_reaches(a->cell[2], a->cell[0]->map),
+        "Function 'map-put' cannot store a map inside itself");
+
+    nval* m = nval_pop(a, 0);
+    nval* k = nval_pop(a, 0);
+    nval_map_put(m, k, nval_pop(a, 0));
+    nval_del(a);
+    return m;
+}
+
+/* Remove a key in place and return the map */
+nval* builtin_map_del(nenv* e, nval* a) {
+    LASSERT_NUM("map-del", a, 2);
+    LASSERT_TYPE("map-del", a, 0, NVAL_MAP);
+    LASSERT_MAP_KEY("map-del", a, 1);
+
+    nval* m = nval_pop(a, 0);
+    nval_map_del(m, a->cell[0]);
+    nval_del(a);
+    return m;
+}
+
+nval* builtin_map_has(nenv* e, nval* a) {
+    LASSERT_NUM("map-has", a, 2);
+    LASSERT_TYPE("map-has", a, 0, NVAL_MAP);
+    LASSERT_MAP_KEY("map-has", a, 1);
+
+    nval* x = nval_num(nval_map_get(a->cell[0], a->cell[1]) != NULL);
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_map_len(nenv* e, nval* a) {
+    LASSERT_NUM("map-len", a, 1);
+    LASSERT_TYPE("map-len", a, 0, NVAL_MAP);
+
+    nval* x = nval_num(a->cell[0]->map->count);
+    nval_del(a);
+    return x;
+}
+
+/* List the keys, values or {key value} pairs of a map */
+nval* builtin_map_iter(nenv* e, nval* a, char* func) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, NVAL_MAP);
+
+    nval* m = a->cell[0];
+    nval* x = nval_qexpr();
+    for (int i = nval_map_next(m, 0); i != -1; i = nval_map_next(m, i+1)) {
+        if (strcmp(func, "map-keys") == 0) {
+            x = nval_add(x, nval_copy(m->map->keys[i]));
+        }
+        if (strcmp(func, "map-vals") == 0) {
+            x = nval_add(x, nval_copy(m->map->vals[i]));
+        }
+        if (strcmp(func, "map-items") == 0) {
+            nval* pair = nval_add(nval_qexpr(), nval_copy(m->map->keys[i]));
+            x = nval_add(x, nval_add(pair, nval_copy(m->map->vals[i])));
+        }
+    }
+    nval_del(a);
+    return x;
+}
+
+nval* builtin_map_keys(nenv* e, nval* a) {
+    return builtin_map_iter(e, a, "map-keys");
+}
+
+nval* builtin_map_vals(nenv* e, nval* a) {
+    return builtin_map_iter(e, a, "map-vals");
+}
+
+nval* builtin_map_items(nenv* e, nval* a) {
+    return builtin_map_iter(e, a, "map-items");
+}
+
 /* Take a Q-Expression and return a Q-Expression with only the first element */
 nval* builtin_head(nenv* e, nval* a) {
     LASSERT_NUM("head", a, 1);
@@ -265,13 +1324,19 @@ nval* builtin_strconcat(nenv* e, nval* a) {
     }
 
     if (full_length > 0) {
-        char full_string[full_length];
-        strcpy(full_string, a->cell[0]->str);
-        for (int i = 1; i < a->count; i++) {
-            strcat(full_string, a->cell[i]->str);
+        /* Built on the heap, long strings would overflow the stack */
+        char* full_string = malloc(full_length + 1);
+        char* end = full_string;
+        for (int i = 0; i < a->count; i++) {
+            size_t n = strlen(a->cell[i]->str);
+            memcpy(end, a->cell[i]->str, n);
+            end += n;
         }
+        *end = '\0';
         nval_del(a);
-        return nval_str(full_string);
+        nval* x = nval_str(full_string);
+        free(full_string);
+        return x;
     } else {
         return nval_err("String length is 0");
     }
@@ -289,6 +1354,13 @@ nval* builtin_put(nenv* e, nval* a) {
     return builtin_var(e, a, "=");
 }
 
+/* Lambdas take the name they are first bound to, for the profiler */
+static void builtin_var_name(nval* sym, nval* v) {
+    if (v->type == NVAL_FUN && v->builtin == NULL && v->name == NULL) {
+        v->name = nprofile_intern(sym->sym);
+    }
+}
+
 nval* builtin_var(nenv* e, nval* a, char* func) {
     LASSERT_NUM(func, a, 2);
     if (a->cell[0]->type != NVAL_SYM && a->cell[0]->type != NVAL_SEXPR) {
@@ -309,6 +1381,7 @@ nval* builtin_var(nenv* e, nval* a, char* func) {
 
         for (int i = 0; i < syms->count; i++) {
             a->cell[i+1] = nval_eval(e, a->cell[i+1]);
+            builtin_var_name(syms->cell[i], a->cell[i+1]);
             /* If 'def' define in globally. If 'put' define in locally */
             if (strcmp(func, "def") == 0) {
                 if (!nenv_def(e, syms->cell[i], a->cell[i+1])) {
@@ -325,6 +1398,10 @@ nval* builtin_var(nenv* e, nval* a, char* func) {
             }
 
             if (strcmp(func, "=")   == 0) {
+                if (nenv_is_protected(e, syms->cell[i])) {
+                    nval_del(a);
+                    return nval_err("Cannot redefine constants");
+                }
                 nenv_put(e, syms->cell[i], a->cell[i+1]);
             }
         }
@@ -339,6 +1416,9 @@ nval* builtin_var(nenv* e, nval* a, char* func) {
         if (a->cell[1]->type == NVAL_SEXPR) {
             a->cell[1] = nval_eval(e, a->cell[1]);
         }
+        if (a->cell[0]->type == NVAL_SYM) {
+            builtin_var_name(a->cell[0], a->cell[1]);
+        }
 
         if (strcmp(func, "def") == 0) {
             if (!nenv_def(e, a->cell[0], a->cell[1])) {
@@ -355,6 +1435,10 @@ nval* builtin_var(nenv* e, nval* a, char* func) {
         }
 
         if (strcmp(func, "=") == 0) {
+            if (a->cell[0]->type == NVAL_SYM && nenv_is_protected(e, a->cell[0])) {
+                nval_del(a);
+                return nval_err("Cannot redefine constants");
+            }
             nenv_put(e, a->cell[0], a->cell[1]);
         }
     }
@@ -391,14 +1475,172 @@ nval* builtin_lambda(nenv* e, nval* a) {
     for (int i = 0; i < a->cell[0]->count; i++) {
         LASSERT(a, (a->cell[0]->cell[i]->type == NVAL_SYM),
             ntype_name(a->cell[0]->cell[i]->type), ntype_name(NVAL_SYM));
+        /* Scope is dynamic, so a formal would also rebind the name for every function called */
+        LASSERT(a, !nenv_is_protected(e, a->cell[0]->cell[i]),
+            "Function '\\' cannot bind constant '%s' as a formal", a->cell[0]->cell[i]->sym);
     }
 
     nval* formals = nval_pop(a, 0);
     nval* body = nval_pop(a, 0);
     nval_del(a);
+
+    nval* bound = nval_copy(formals);
+    nval_fold_bound(body, bound);
+    nval_fold_body(e, body, bound);
+    nval_del(bound);
+
     return nval_lambda(formals, body);
 }
 
+/*
+ * Constant folding for function bodies, run when '\' creates a function.
+ * Calls to pure builtins whose arguments are all constants are evaluated
+ * once here, and an 'if' with a constant condition is replaced by the
+ * branch it takes. Symbols bound to protected globals are treated as
+ * those constants. Protected names cannot be bound as formals or with =,
+ * so no caller can rebind them for the function at run time.
+ */
+static nbuiltin builtin_pure[] = {
+    builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_modulus,
+    builtin_eq, builtin_ne, builtin_gt, builtin_lt, builtin_ge, builtin_le,
+    builtin_strconcat, NULL
+};
+
+static bool nval_fold_is_pure(nbuiltin f) {
+    for (int i = 0; builtin_pure[i]; i++) {
+        if (builtin_pure[i] == f) { return true; }
+    }
+    return false;
+}
+
+static bool nval_fold_is_literal(nval* v) {
+    return v->type == NVAL_NUM || v->type == NVAL_DOUBLE
+        || v->type == NVAL_STR || v->type == NVAL_QEXPR;
+}
+
+static bool nval_fold_is_bound(nval* bound, nval* sym) {
+    for (int i = 0; i < bound->count; i++) {
+        if (strcmp(bound->cell[i]->sym, sym->sym) == 0) { return true; }
+    }
+    return false;
+}
+
+/* Protected value a symbol refers to, NULL if the function may rebind it */
+static nval* nval_fold_lookup(nenv* e, nval* sym, nval* bound) {
+    if (sym->type != NVAL_SYM || nval_fold_is_bound(bound, sym)) { return NULL; }
+    return nenv_get_protected(e, sym);
+}
+
+/* Collect every name the body binds with =, def, const, \, fun or pfun */
+void nval_fold_bound(nval* x, nval* bound) {
+    static char* binders[] = { "=", "def", "const", "\\", "fun", "pfun", NULL };
+
+    if (x->count >= 2 && x->cell[0]->type == NVAL_SYM && x->cell[1]->type == NVAL_QEXPR) {
+        for (int i = 0; binders[i]; i++) {
+            if (strcmp(x->cell[0]->sym, binders[i]) != 0) { continue; }
+            for (int j = 0; j < x->cell[1]->count; j++) {
+                if (x->cell[1]->cell[j]->type == NVAL_SYM) {
+                    nval_add(bound, nval_copy(x->cell[1]->cell[j]));
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i]->type == NVAL_SEXPR || x->cell[i]->type == NVAL_QEXPR) {
+            nval_fold_bound(x->cell[i], bound);
+        }
+    }
+}
+
+/* Fold the expression list x in place. Returns a value to replace x with, or NULL */
+nval* nval_fold_call(nenv* e, nval* x, nval* bound) {
+    if (x->count == 0) { return NULL; }
+
+    /* Arguments to macros are not evaluated, leave them alone */
+    nval* f = nval_fold_lookup(e, x->cell[0], bound);
+    if (f && f->type == NVAL_FUN_MACRO) { return NULL; }
+
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i]->type == NVAL_SEXPR) {
+            nval* r = nval_fold_call(e, x->cell[i], bound);
+            if (r) {
+                nval_del(x->cell[i]);
+                x->cell[i] = r;
+            }
+        } else if (x->cell[i]->type == NVAL_SYM) {
+            nval* k = nval_fold_lookup(e, x->cell[i], bound);
+            if (k && nval_fold_is_literal(k)) {
+                nval_del(x->cell[i]);
+                x->cell[i] = nval_copy(k);
+            }
+        }
+    }
+
+    /* A lone constant evaluates to itself */
+    if (x->count == 1 && x->cell[0]->type != NVAL_QEXPR && nval_fold_is_literal(x->cell[0])) {
+        return nval_copy(x->cell[0]);
+    }
+
+    if (!f || f->type != NVAL_FUN || !f->builtin) { return NULL; }
+
+    if (f->builtin == builtin_if && (x->count == 3 || x->count == 4)) {
+        /* Branches are code, fold them too */
+        for (int i = 2; i < x->count; i++) {
+            if (x->cell[i]->type == NVAL_QEXPR) {
+                nval_fold_body(e, x->cell[i], bound);
+            }
+        }
+
+        if (x->cell[1]->type != NVAL_NUM) { return NULL; }
+        int taken = x->cell[1]->num ? 2 : 3;
+        if (taken >= x->count || x->cell[taken]->type != NVAL_QEXPR) { return NULL; }
+
+        nval* branch = nval_copy(x->cell[taken]);
+        branch->type = NVAL_SEXPR;
+        return branch;
+    }
+
+    if (nval_fold_is_pure(f->builtin)) {
+        nval* args = nval_sexpr();
+        for (int i = 1; i < x->count; i++) {
+            if (!nval_fold_is_literal(x->cell[i])) {
+                nval_del(args);
+                return NULL;
+            }
+            args = nval_add(args, nval_copy(x->cell[i]));
+        }
+
+        /* Errors are left for the call so they are reported at run time */
+        nval* r = f->builtin(e, args);
+        if (r->type == NVAL_ERR) {
+            nval_del(r);
+            return NULL;
+        }
+        return r;
+    }
+
+    return NULL;
+}
+
+/* Fold a function body, or an if branch, which is evaluated as one S-Expression */
+void nval_fold_body(nenv* e, nval* body, nval* bound) {
+    nval* r = nval_fold_call(e, body, bound);
+    if (!r) { return; }
+
+    while (body->count) {
+        nval_del(nval_pop(body, 0));
+    }
+    if (r->type == NVAL_SEXPR) {
+        while (r->count) {
+            nval_add(body, nval_pop(r, 0));
+        }
+        nval_del(r);
+    } else {
+        nval_add(body, r);
+    }
+}
+
 nval* builtin_gt(nenv* e, nval* a) {
     return builtin_ord(e, a, ">");
 }
@@ -415,12 +1657,47 @@ nval* builtin_le(nenv* e, nval* a) {
     return builtin_ord(e, a, "<=");
 }
 
+/* Element-wise comparison when at least one argument is an array */
+static nval* builtin_ord_array(nval* a, char* op) {
+    int n = nval_array_args_len(a);
+    LASSERT(a, n >= 0, "Function '%s' passed arrays of different lengths", op);
+
+    nval* r = nval_array(NVAL_NUM, n);
+    if (nval_array_args_double(a)) {
+        double* x = malloc(sizeof(double) * (n ? n : 1));
+        double* y = malloc(sizeof(double) * (n ? n : 1));
+        nval_array_fill_double(a->cell[0], x, n);
+        nval_array_fill_double(a->cell[1], y, n);
+        narray_cmp_double(op, r->nums, x, y, n);
+        free(x);
+        free(y);
+    } else {
+        long* x = malloc(sizeof(long) * (n ? n : 1));
+        long* y = malloc(sizeof(long) * (n ? n : 1));
+        nval_array_fill_long(a->cell[0], x, n);
+        nval_array_fill_long(a->cell[1], y, n);
+        narray_cmp_long(op, r->nums, x, y, n);
+        free(x);
+        free(y);
+    }
+    nval_del(a);
+    return r;
+}
+
 nval* builtin_ord(nenv* e, nval* a, char* op) {
     LASSERT_NUM(op, a, 2);
+    if (a->cell[0]->type == NVAL_ARRAY || a->cell[1]->type == NVAL_ARRAY) {
+        for (int i = 0; i < 2; i++) {
+            LASSERT(a, a->cell[i]->type == NVAL_NUM || a->cell[i]->type == NVAL_DOUBLE
+                || a->cell[i]->type == NVAL_ARRAY,
+                "Function '%s' cannot work on non-numbers", op);
+        }
+        return builtin_ord_array(a, op);
+    }
     LASSERT(a, a->cell[0]->type == NVAL_NUM || a->cell[0]->type == NVAL_DOUBLE,
-        "Function '%s' cannot work on non-numbers");
+        "Function '%s' cannot work on non-numbers", op);
     LASSERT(a, a->cell[1]->type == NVAL_NUM || a->cell[1]->type == NVAL_DOUBLE,
-        "Function '%s' cannot work on non-numbers");
+        "Function '%s' cannot work on non-numbers", op);
 
     /* Convert to double for comparison */
     if (a->cell[0]->type == NVAL_NUM) {
@@ -460,6 +1737,29 @@ int nval_eq(nval* x, nval* y) {
     case NVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
     case NVAL_STR: return (strcmp(x->str, y->str) == 0);
 
+    case NVAL_VEC:
+      if (nval_vec_len(x) != nval_vec_len(y)) { return 0; }
+      for (int i = 0; i < nval_vec_len(x); i++) {
+        if (!nval_eq(nval_vec_items(x)[i], nval_vec_items(y)[i])) { return 0; }
+      }
+      return 1;
+
+    case NVAL_MAP:
+      if (x->map->count != y->map->count) { return 0; }
+      for (int i = nval_map_next(x, 0); i != -1; i = nval_map_next(x, i+1)) {
+        nval* v = nval_map_get(y, x->map->keys[i]);
+        if (!v || !nval_eq(x->map->vals[i], v)) { return 0; }
+      }
+      return 1;
+
+    case NVAL_ARRAY:
+      if (x->arr_type != y->arr_type || x->count != y->count) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        if (x->arr_type == NVAL_DOUBLE && x->doubs[i] != y->doubs[i]) { return 0; }
+        if (x->arr_type == NVAL_NUM && x->nums[i] != y->nums[i]) { return 0; }
+      }
+      return 1;
+
     case NVAL_FUN:
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
@@ -518,13 +1818,10 @@ nval* builtin_if(nenv* e, nval* a) {
     /* Only truth evaluation is given */
     if (a->cell[0]->num) {
         x = nval_eval(e, nval_pop(a, 1));
-    }
-
-    if (!a->cell[0]->num && a->count > 2) {
+    } else if (a->count > 2) {
         /* Both evaluations are given and is false */
         x = nval_eval(e, nval_pop(a, 2));
-    }
-    if (!a->cell[0]->num && a->count < 2) {
+    } else {
         /* False evaluation was NOT given */
         x = nval_qexpr();
     }
@@ -8,9 +8,8 @@ void nenv_add_builtin(nenv* e, char* name, nbuiltin func);
 void nenv_add_builtin_macro(nenv* e, char* name, nbuiltin func);
 void nenv_add_builtins(nenv* e);
 
-mpc_parser_t* Nitrogen;
 nval* builtin_load(nenv* e, nval* a);
-nval* nval_read(mpc_ast_t* t);
+nval* builtin_load_forms(nenv* e, nval* forms);
 
 /* Arithmatic operations */
 nval* builtin_op(nenv* e, nval* a, char* op);
@@ -20,6 +19,37 @@ nval* builtin_mul(nenv* e, nval* a);
 nval* builtin_div(nenv* e, nval* a);
 nval* builtin_modulus(nenv* e, nval* a);
 
+/* Packed numeric array functions */
+nval* builtin_array(nenv* e, nval* a);
+nval* builtin_array_list(nenv* e, nval* a);
+nval* builtin_array_len(nenv* e, nval* a);
+nval* builtin_array_reduce(nenv* e, nval* a, char op, char* func);
+nval* builtin_array_sum(nenv* e, nval* a);
+nval* builtin_array_product(nenv* e, nval* a);
+nval* builtin_array_min(nenv* e, nval* a);
+nval* builtin_array_max(nenv* e, nval* a);
+
+/* Vector functions */
+nval* builtin_vec(nenv* e, nval* a);
+nval* builtin_vec_list(nenv* e, nval* a);
+nval* builtin_vec_len(nenv* e, nval* a);
+nval* builtin_vec_get(nenv* e, nval* a);
+nval* builtin_vec_set(nenv* e, nval* a);
+nval* builtin_vec_push(nenv* e, nval* a);
+nval* builtin_vec_slice(nenv* e, nval* a);
+
+/* Hash map functions */
+nval* builtin_map_new(nenv* e, nval* a);
+nval* builtin_map_get(nenv* e, nval* a);
+nval* builtin_map_put(nenv* e, nval* a);
+nval* builtin_map_del(nenv* e, nval* a);
+nval* builtin_map_has(nenv* e, nval* a);
+nval* builtin_map_len(nenv* e, nval* a);
+nval* builtin_map_iter(nenv* e, nval* a, char* func);
+nval* builtin_map_keys(nenv* e, nval* a);
+nval* builtin_map_vals(nenv* e, nval* a);
+nval* builtin_map_items(nenv* e, nval* a);
+
 /* Q-Expression functions */
 nval* builtin_head(nenv* e, nval* a);
 nval* builtin_tail(nenv* e, nval* a);
@@ -29,6 +59,30 @@ nval* builtin_join(nenv* e, nval* a);
 
 nval* builtin_strconcat(nenv* e, nval* a);
 nval* builtin_pool_stats(nenv* e, nval* a);
+nval* builtin_metrics(nenv* e, nval* a);
+
+/* Timing */
+nval* builtin_time_ns(nenv* e, nval* a);
+nval* builtin_cpu_time_ns(nenv* e, nval* a);
+nval* builtin_bench(nenv* e, nval* a);
+nval* builtin_perf_measure(nenv* e, nval* a);
+
+/* Writes a report or trace to out, false if it could not */
+typedef bool (*nwriter)(FILE* out);
+/* Call write on the file at path, or on stdout when path is NULL, closing the file after.
+ * False if the file could not be opened, written or closed */
+bool builtin_write_file(char* path, nwriter write);
+
+nval* builtin_profile_start(nenv* e, nval* a);
+nval* builtin_profile_stop(nenv* e, nval* a);
+nval* builtin_profile_report(nenv* e, nval* a);
+nval* builtin_trace_start(nenv* e, nval* a);
+nval* builtin_trace_stop(nenv* e, nval* a);
+nval* builtin_alloc_profile_start(nenv* e, nval* a);
+nval* builtin_alloc_profile_stop(nenv* e, nval* a);
+nval* builtin_alloc_profile_report(nenv* e, nval* a);
+/* Allocations by function as a table on stdout, CSV in files */
+bool builtin_alloc_profile_write(FILE* out);
 
 /* Variable and functions definitions */
 nval* builtin_def(nenv* e, nval* a);
@@ -38,6 +92,11 @@ nval* builtin_var(nenv* e, nval* a, char* func);
 nval* builtin_undef(nenv* e, nval* a);
 nval* builtin_lambda(nenv* e, nval* a);
 
+/* Constant folding of function bodies */
+void nval_fold_bound(nval* x, nval* bound);
+nval* nval_fold_call(nenv* e, nval* x, nval* bound);
+void nval_fold_body(nenv* e, nval* body, nval* bound);
+
 /* Logical operators */
 nval* builtin_gt(nenv* e, nval* a);
 nval* builtin_lt(nenv* e, nval* a);
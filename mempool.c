@@ -5,32 +5,63 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <valgrind/memcheck.h>
 
 #include "ncore.h"
 #include "mempool.h"
+#include "nprofile.h"
 
-#define MAX_NUM_OF_POOLS 10
 #define POOL_SIZE 1000
 
-/* Group of memory pools for nvals */
-static memory_pool* nval_mem_pool[MAX_NUM_OF_POOLS];
+/* Group of memory pools for nvals, grown as pools are created */
+static memory_pool** nval_mem_pool = NULL;
+static int pool_capacity = 0;
 
 /* Statistics */
-static int total_allocated_chunks = 0;
+static long total_allocated_chunks = 0;
+static long total_freed_chunks = 0;
 static int total_currently_allocated_chunks = 0;
 static int highest_allocated_chunks = 0;
 
 static int created_pools = 0;
+
+/* Chunks that have been freed, most recent first */
+static mem_control_block* free_chunks = NULL;
+
 static size_t nval_chunk_size = sizeof(nval) + sizeof(mem_control_block);
 
+/* Allocation profiling */
+bool pool_profiling = false;
+
+/* Allocations made by a function, directly or by a builtin it called */
+typedef struct pool_site {
+	bool used;
+	const char* function;
+	const char* builtin;
+	long chunks;
+	long mallocs;
+	long malloc_bytes;
+} pool_site;
+
+/* Open addressing, capacity is always a power of two */
+static pool_site* sites = NULL;
+static int site_count = 0;
+static int site_capacity = 0;
+
 /* Create new pools at index pnum */
 void create_pool(int pnum) {
+	if (pnum >= pool_capacity) {
+		pool_capacity = pool_capacity ? pool_capacity * 2 : 16;
+		nval_mem_pool = realloc(nval_mem_pool, sizeof(memory_pool*) * pool_capacity);
+	}
 	nval_mem_pool[pnum] = malloc(sizeof(memory_pool));
 	nval_mem_pool[pnum]->mem_chunk_size = nval_chunk_size;
 	nval_mem_pool[pnum]->memory_pool_start =  malloc(POOL_SIZE * nval_chunk_size);
 	nval_mem_pool[pnum]->memory_pool_last_assignable = nval_mem_pool[pnum]->memory_pool_start + (POOL_SIZE * nval_mem_pool[pnum]->mem_chunk_size) - nval_mem_pool[pnum]->mem_chunk_size; // Last usable address
 	nval_mem_pool[pnum]->memory_pool_end = nval_mem_pool[pnum]->memory_pool_start + (POOL_SIZE * nval_mem_pool[pnum]->mem_chunk_size);
+	nval_mem_pool[pnum]->memory_pool_next_unused = nval_mem_pool[pnum]->memory_pool_start;
 	nval_mem_pool[pnum]->chunks_allocated = 0;
 	VALGRIND_CREATE_MEMPOOL(nval_mem_pool[pnum], 0, 0);
 	created_pools++;
@@ -39,68 +70,54 @@ void create_pool(int pnum) {
 
 /* Find and return a pointer to an nval sized chunk */
 void* nmalloc(void) {
-	void* current_location;
-	mem_control_block* current_location_mcb;
-	void* memory_location = NULL;
+	mem_control_block* mcb = free_chunks;
 
-	/* Loop through pools to find a free address */
-	for (int i = 0; i < created_pools; i++) {
-		/* If a pool is uninitialized, all pool after it will be too */
-		if (nval_mem_pool[i] == NULL) {
-			break;
-		}
-
-		current_location = nval_mem_pool[i]->memory_pool_start;
-		memory_location = nval_mem_pool[i]->memory_pool_start;
-
-		/* Loop over pool address range to find a free memory chunk */
-		while (current_location < nval_mem_pool[i]->memory_pool_last_assignable) {
-			current_location_mcb = current_location;
-			if (current_location_mcb->is_used) {
-				/* Chunk in use */
-				current_location = current_location + nval_mem_pool[i]->mem_chunk_size;
-				continue;
-			} else {
-				/* Chunk is not in use or is unitialized */
-				current_location_mcb->is_used = true;
-				memory_location = current_location + sizeof(mem_control_block);
-				nval_mem_pool[i]->chunks_allocated++;
-				/* Stats */
-				total_allocated_chunks++;
-				total_currently_allocated_chunks++;
-				if (total_currently_allocated_chunks > highest_allocated_chunks) {
-					highest_allocated_chunks = total_allocated_chunks;
-				}
-				VALGRIND_MEMPOOL_ALLOC(nval_mem_pool[i], memory_location, sizeof(nval));
-				return memory_location;
-				break;
-			}
+	if (mcb) {
+		/* Reuse the chunk freed most recently */
+		free_chunks = mcb->next_free;
+	} else {
+		/* Chunks of the newest pool are handed out in order the first time they are needed */
+		memory_pool* newest = created_pools ? nval_mem_pool[created_pools-1] : NULL;
+		if (newest == NULL || newest->memory_pool_next_unused >= newest->memory_pool_end) {
+			create_pool(created_pools);
+			newest = nval_mem_pool[created_pools-1];
 		}
+		mcb = newest->memory_pool_next_unused;
+		mcb->pool = created_pools - 1;
+		newest->memory_pool_next_unused += newest->mem_chunk_size;
 	}
 
-	/* All pools have been checked and are exhausted */
-	if (created_pools < MAX_NUM_OF_POOLS) {
-		create_pool(created_pools);
-		return nmalloc();
-	} else {
-		printf("No more memory available\n");
+	memory_pool* pool = nval_mem_pool[mcb->pool];
+	void* memory_location = (void*)mcb + sizeof(mem_control_block);
+	mcb->is_used = true;
+	pool->chunks_allocated++;
+
+	if (pool_profiling) {
+		pool_profile_record(true, nval_chunk_size);
 	}
 
-	return NULL;
+	/* Stats */
+	total_allocated_chunks++;
+	total_currently_allocated_chunks++;
+	if (total_currently_allocated_chunks > highest_allocated_chunks) {
+		highest_allocated_chunks = total_currently_allocated_chunks;
+	}
+	VALGRIND_MEMPOOL_ALLOC(pool, memory_location, sizeof(nval));
+	return memory_location;
 }
 
 void nfree(void* p) {
 	mem_control_block* mcb;
 	mcb = p - sizeof(mem_control_block);
 	mcb->is_used = false;
+	mcb->next_free = free_chunks;
+	free_chunks = mcb;
+
+	nval_mem_pool[mcb->pool]->chunks_allocated--;
+	VALGRIND_MEMPOOL_FREE(nval_mem_pool[mcb->pool], p);
 
-	for (int i = 0; i < created_pools; i++) {
-		if (p >= nval_mem_pool[i]->memory_pool_start && p < nval_mem_pool[i]->memory_pool_end) {
-			nval_mem_pool[i]->chunks_allocated--;
-			VALGRIND_MEMPOOL_FREE(nval_mem_pool[i], p);
-		}
-	}
 	total_currently_allocated_chunks--;
+	total_freed_chunks++;
 	return;
 }
 
@@ -110,16 +127,153 @@ void deallocate_pools(void) {
 		free(nval_mem_pool[i]);
 		VALGRIND_DESTROY_MEMPOOL(nval_mem_pool[i]);
 	}
+	free(nval_mem_pool);
+	nval_mem_pool = NULL;
+	free(sites);
+	sites = NULL;
+	site_count = 0;
+	site_capacity = 0;
+	pool_profiling = false;
+	pool_capacity = 0;
+	free_chunks = NULL;
+	created_pools = 0;
 	return;
 }
 
+/* Running totals over every pool */
+memory_pool_counts pool_counts(void) {
+	memory_pool_counts c;
+	c.allocations = total_allocated_chunks;
+	c.frees = total_freed_chunks;
+	c.live = total_currently_allocated_chunks;
+	c.peak = highest_allocated_chunks;
+	c.pools = created_pools;
+	c.bytes = created_pools * (sizeof(memory_pool) + POOL_SIZE * nval_chunk_size);
+	return c;
+}
+
+/* Usage of pool pnum, which must be below pool_counts().pools */
+memory_pool_usage pool_usage(int pnum) {
+	memory_pool* pool = nval_mem_pool[pnum];
+	memory_pool_usage u;
+	u.chunks = POOL_SIZE;
+	u.used = pool->chunks_allocated;
+	u.high_water = (pool->memory_pool_next_unused - pool->memory_pool_start) / pool->mem_chunk_size;
+	return u;
+}
+
+/* Bytes each value takes in a pool, header included */
+size_t pool_chunk_size(void) {
+	return nval_chunk_size;
+}
+
+void pool_profile_start(void) {
+	free(sites);
+	sites = NULL;
+	site_count = 0;
+	site_capacity = 0;
+	pool_profiling = true;
+}
+
+void pool_profile_stop(void) {
+	pool_profiling = false;
+}
+
+static uint64_t pool_site_slot(const char* function, const char* builtin, int capacity) {
+	uint64_t h = (uint64_t)(uintptr_t)function * 31 + (uint64_t)(uintptr_t)builtin;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (h >> 32) & (capacity - 1);
+}
+
+/* Count an allocation against the function and builtin running now */
+void pool_profile_record(bool chunk, size_t bytes) {
+	const char* function;
+	const char* builtin;
+	nprofile_current(&function, &builtin);
+
+	if (site_count * 2 >= site_capacity) {
+		int capacity = site_capacity ? site_capacity * 2 : 256;
+		pool_site* grown = calloc(capacity, sizeof(pool_site));
+		for (int i = 0; i < site_capacity; i++) {
+			if (!sites[i].used) { continue; }
+			uint64_t j = pool_site_slot(sites[i].function, sites[i].builtin, capacity);
+			while (grown[j].used) { j = (j + 1) & (capacity - 1); }
+			grown[j] = sites[i];
+		}
+		free(sites);
+		sites = grown;
+		site_capacity = capacity;
+	}
+
+	uint64_t i = pool_site_slot(function, builtin, site_capacity);
+	while (sites[i].used && (sites[i].function != function || sites[i].builtin != builtin)) {
+		i = (i + 1) & (site_capacity - 1);
+	}
+	pool_site* site = &sites[i];
+	if (!site->used) {
+		site->used = true;
+		site->function = function;
+		site->builtin = builtin;
+		site_count++;
+	}
+
+	if (chunk) {
+		site->chunks++;
+	} else {
+		site->mallocs++;
+		site->malloc_bytes += bytes;
+	}
+}
+
+static long pool_site_bytes(const pool_site* site) {
+	return site->chunks * nval_chunk_size + site->malloc_bytes;
+}
+
+static int pool_site_order(const void* a, const void* b) {
+	long x = pool_site_bytes(a);
+	long y = pool_site_bytes(b);
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+bool pool_profile_report(FILE* out, bool csv) {
+	pool_site* sorted = malloc(sizeof(pool_site) * (site_count + 1));
+	int n = 0;
+	for (int i = 0; i < site_capacity; i++) {
+		if (sites[i].used) { sorted[n++] = sites[i]; }
+	}
+	qsort(sorted, n, sizeof(pool_site), pool_site_order);
+
+	if (csv) {
+		fprintf(out, "function,builtin,nvals,nval_bytes,mallocs,malloc_bytes\n");
+	} else {
+		fprintf(out, "%-20s %-16s %10s %12s %10s %12s %12s\n", "function", "builtin",
+			"nvals", "nval bytes", "mallocs", "malloc bytes", "total bytes");
+	}
+	for (int i = 0; i < n; i++) {
+		pool_site* site = &sorted[i];
+		const char* function = site->function ? site->function : "toplevel";
+		if (csv) {
+			fprintf(out, "\"%s\",\"%s\",%ld,%ld,%ld,%ld\n", function,
+				site->builtin ? site->builtin : "", site->chunks,
+				(long)(site->chunks * nval_chunk_size), site->mallocs, site->malloc_bytes);
+		} else {
+			fprintf(out, "%-20s %-16s %10ld %12ld %10ld %12ld %12ld\n", function,
+				site->builtin ? site->builtin : "(none)", site->chunks,
+				(long)(site->chunks * nval_chunk_size), site->mallocs, site->malloc_bytes,
+				pool_site_bytes(site));
+		}
+	}
+	free(sorted);
+	return fflush(out) == 0;
+}
+
 void pool_stats(void) {
 	printf("Number of Pools: %d\n", created_pools);
 	printf("Size of mem_control_block: %li\n", sizeof(mem_control_block));
 	printf("Size of Pool Header: %li\n", sizeof(memory_pool));
 	printf("Currently Allocated Chunks: %d\n", total_currently_allocated_chunks);
 	printf("Highest Allocated Chunks: %d\n", highest_allocated_chunks);
-	printf("Total Allocated Chunks: %d\n", total_allocated_chunks);
+	printf("Total Allocated Chunks: %ld\n", total_allocated_chunks);
 
 	for (int i = 0; i < created_pools; i++) {
 		putchar('\n');
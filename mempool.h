@@ -1,8 +1,13 @@
 #ifndef nmempool
 #define nmemppol
+#include <stdio.h>
 
 typedef struct mem_control_block {
     bool is_used;
+    /* Index of the pool the chunk belongs to */
+    int pool;
+    /* Next chunk on the free list while this one is free */
+    struct mem_control_block* next_free;
 } mem_control_block;
 
 typedef struct memory_pool {
@@ -10,13 +15,48 @@ typedef struct memory_pool {
     void* memory_pool_start;
     void* memory_pool_end;
     void* memory_pool_last_assignable;
+    /* Chunks from here to the end have never been handed out */
+    void* memory_pool_next_unused;
     size_t mem_chunk_size;
 } memory_pool;
 
+/* Running totals over every pool */
+typedef struct memory_pool_counts {
+    long allocations;
+    long frees;
+    int live;
+    int peak;
+    int pools;
+    /* Bytes held by the pools, including chunk and pool headers */
+    long bytes;
+} memory_pool_counts;
+
+/* Allocation profiling, attributing allocations to the Nitrogen function making them */
+extern bool pool_profiling;
+void pool_profile_start(void);
+void pool_profile_stop(void);
+void pool_profile_record(bool chunk, size_t bytes);
+/* Allocations by function, most bytes first. As a table, or CSV */
+bool pool_profile_report(FILE* out, bool csv);
+
+/* Count a malloc, or a realloc growing a block to bytes, made to hold values while profiling allocations */
+#define POOL_PROFILE_MALLOC(bytes) \
+    do { if (pool_profiling) { pool_profile_record(false, bytes); } } while (0)
+
+/* Chunks of one pool, in use now and ever handed out */
+typedef struct memory_pool_usage {
+    int chunks;
+    int used;
+    int high_water;
+} memory_pool_usage;
+
 void create_pool(int pnum);
 void* nmalloc(void);
 void nfree(void* p);
 void deallocate_pools(void);
 void pool_stats(void);
+memory_pool_counts pool_counts(void);
+memory_pool_usage pool_usage(int pnum);
+size_t pool_chunk_size(void);
 
 #endif
\ No newline at end of file
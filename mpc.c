@@ -319,11 +319,13 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  long length;
   char *buffer;
   FILE *file;
   
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
@@ -331,7 +333,7 @@ typedef struct {
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, long length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -341,13 +343,16 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = malloc(length + 1);
+  memcpy(i->string, string, length);
+  i->string[length] = '\0';
+  i->length = length;
   i->buffer = NULL;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
 
@@ -356,6 +361,10 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   return i;
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -367,11 +376,13 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -391,11 +402,13 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -423,9 +436,13 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
+  /* Marks are made and dropped for nearly every parser, so the stack only grows */
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
@@ -440,8 +457,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
     free(i->buffer);
@@ -473,7 +488,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -683,7 +698,9 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -701,6 +718,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { int n; int *table; char *accept; int *expected_num; char ***expected; char *re; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -718,6 +736,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -727,6 +746,121 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** Run a compiled regex over the input, taking
+** the longest match. String input is scanned in
+** place and only consumed once the match is known.
+**
+** Like the combinators, the characters expected
+** where the scan stopped are reported in e, both
+** when the match fails and when it succeeds.
+*/
+
+static mpc_err_t *mpc_input_dfa_err(mpc_input_t *i, mpc_pdata_dfa_t *d, int s, mpc_state_t st, char recieved) {
+  
+  mpc_err_t *e;
+  int k;
+  
+  if (d->expected_num[s] == 0) { return NULL; }
+  
+  e = mpc_err_new(i->filename, st, d->expected[s][0], recieved);
+  for (k = 1; k < d->expected_num[s]; k++) {
+    mpc_err_add_expected(e, d->expected[s][k]);
+  }
+  return e;
+}
+
+static void mpc_input_dfa_advance(mpc_state_t *st, char c) {
+  st->pos++;
+  st->col++;
+  if (c == '\n') {
+    st->col = 0;
+    st->row++;
+  }
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o, mpc_err_t **e) {
+  
+  long start = i->state.pos, end = -1, j, k;
+  int s = 0, next, n = 0, size = 0, backtrack;
+  char x = '\0', *buf = NULL;
+  mpc_state_t st;
+  
+  if (d->accept[0]) { end = start; }
+  
+  if (i->type == MPC_INPUT_STRING) {
+    
+    for (j = start; j < i->length; j++) {
+      next = d->table[s * 256 + (unsigned char)i->string[j]];
+      if (next < 0) { break; }
+      s = next;
+      if (d->accept[s]) { end = j + 1; }
+    }
+    
+    /* Consume the match, then find where the scan stopped for the error */
+    st = i->state;
+    for (k = start; k < j; k++) {
+      if (k == end) { i->state = st; }
+      mpc_input_dfa_advance(&st, i->string[k]);
+    }
+    if (end == j) { i->state = st; }
+    *e = mpc_input_dfa_err(i, d, s, st, i->string[j]);
+    
+    if (end < 0) { return 0; }
+    if (end > start) { i->last = i->string[end-1]; }
+    
+    *o = malloc(end - start + 1);
+    memcpy(*o, i->string + start, end - start);
+    (*o)[end - start] = '\0';
+    return 1;
+  }
+  
+  /* Files and pipes are read ahead and rewound to the end of the match,
+     which needs a mark even when backtracking is otherwise disabled */
+  backtrack = i->backtrack;
+  i->backtrack = 1;
+  mpc_input_mark(i);
+  while (1) {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { x = '\0'; break; }
+    next = d->table[s * 256 + (unsigned char)x];
+    if (next < 0) { mpc_input_failure(i, x); break; }
+    mpc_input_success(i, x, NULL);
+    if (n + 1 >= size) {
+      size = size ? size * 2 : 64;
+      buf = realloc(buf, size);
+    }
+    buf[n++] = x;
+    s = next;
+    if (d->accept[s]) { end = start + n; }
+  }
+  *e = mpc_input_dfa_err(i, d, s, i->state, x);
+  
+  if (end < 0) {
+    mpc_input_rewind(i);
+    i->backtrack = backtrack;
+    free(buf);
+    return 0;
+  }
+  
+  if (end < start + n) {
+    mpc_input_rewind(i);
+    for (k = start; k < end; k++) {
+      mpc_input_success(i, mpc_input_getc(i), NULL);
+    }
+  } else {
+    mpc_input_unmark(i);
+  }
+  i->backtrack = backtrack;
+  
+  n = end - start;
+  *o = malloc(n + 1);
+  if (n) { memcpy(*o, buf, n); }
+  (*o)[n] = '\0';
+  free(buf);
+  return 1;
+}
+
 /*
 ** Stack Type
 */
@@ -737,6 +871,7 @@ typedef struct {
   int parsers_slots;
   mpc_parser_t **parsers;
   int *states;
+  long *starts;
 
   int results_num;
   int results_slots;
@@ -754,6 +889,7 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->parsers_slots = 0;
   s->parsers = NULL;
   s->states = NULL;
+  s->starts = NULL;
   
   s->results_num = 0;
   s->results_slots = 0;
@@ -785,6 +921,7 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   
   free(s->parsers);
   free(s->states);
+  free(s->starts);
   free(s->results);
   free(s->returns);
   free(s);
@@ -794,8 +931,14 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
 
 /* Stack Parser Stuff */
 
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+static void mpc_stack_set_state(mpc_stack_t *s, int x, long pos) {
   s->states[s->parsers_num-1] = x;
+  s->starts[s->parsers_num-1] = pos;
+}
+
+/* True if the last child parser consumed input before failing */
+static int mpc_stack_consumed(mpc_stack_t *s, mpc_input_t *i) {
+  return i->backtrack < 1 && s->starts[s->parsers_num-1] != i->state.pos;
 }
 
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
@@ -803,6 +946,7 @@ static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
     s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+    s->starts = realloc(s->starts, sizeof(long) * s->parsers_slots);
   }
 }
 
@@ -811,6 +955,7 @@ static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
     s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+    s->starts = realloc(s->starts, sizeof(long) * s->parsers_slots);
   }
 }
 
@@ -923,6 +1068,12 @@ static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
   }
 }
 
+/* Results of a repeat that failed part way. Without a destructor they can only be dropped */
+static void mpc_stack_popr_repeat(mpc_stack_t *s, int n, mpc_dtor_t dx) {
+  if (dx) { mpc_stack_popr_out_single(s, n, dx); }
+  else { mpc_stack_popr_n(s, n); }
+}
+
 static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
   mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
   mpc_stack_popr_n(s, n);
@@ -956,7 +1107,7 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 ** But it is now a pretty ugly beast...
 */
 
-#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st, i->state.pos); mpc_stack_pushp(stk, x); continue
 #define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
 #define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
 #define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
@@ -971,6 +1122,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   /* Variables */
   char *s;
   mpc_result_t r;
+  mpc_err_t *e;
 
   /* Go! */
   mpc_stack_pushp(stk, init);
@@ -1000,6 +1152,14 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
       case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
       
+      case MPC_TYPE_DFA:
+        if (mpc_input_dfa(i, &p->data.dfa, &s, &e)) {
+          if (e) { mpc_stack_err(stk, e); }
+          MPC_SUCCESS(s);
+        } else {
+          MPC_FAILURE(e ? e : mpc_err_fail(i->filename, i->state, "Incorrect Input"));
+        }
+      
       case MPC_TYPE_ANCHOR:
         if (mpc_input_anchor(i, p->data.anchor.f)) {
           MPC_SUCCESS(NULL);
@@ -1071,6 +1231,8 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(r.output);
+          } else if (mpc_stack_consumed(stk, i)) {
+            MPC_FAILURE(r.error);
           } else {
             mpc_stack_err(stk, r.error);
             MPC_SUCCESS(p->data.not.lf());
@@ -1084,6 +1246,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
             MPC_CONTINUE(st+1, p->data.repeat.x);
+          } else if (mpc_stack_consumed(stk, i)) {
+            mpc_stack_popr(stk, &r);
+            mpc_stack_popr_repeat(stk, st-1, p->data.repeat.dx);
+            MPC_FAILURE(r.error);
           } else {
             mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
@@ -1096,6 +1262,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
             MPC_CONTINUE(st+1, p->data.repeat.x);
+          } else if (mpc_stack_consumed(stk, i) && st > 1) {
+            mpc_stack_popr(stk, &r);
+            mpc_stack_popr_repeat(stk, st-1, p->data.repeat.dx);
+            MPC_FAILURE(r.error);
           } else {
             if (st == 1) {
               mpc_stack_popr(stk, &r);
@@ -1141,8 +1311,8 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             mpc_stack_popr_err(stk, st-1);
             MPC_SUCCESS(r.output);
           }
-          if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+          if (st <  p->data.or.n && !mpc_stack_consumed(stk, i)) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+          MPC_FAILURE(mpc_stack_merger_err(stk, st));
         }
       
       case MPC_TYPE_AND:
@@ -1186,6 +1356,14 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_nstring(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1245,6 +1423,23 @@ static void mpc_undefine_and(mpc_parser_t *p) {
   
 }
 
+static void mpc_undefine_dfa(mpc_parser_t *p) {
+  
+  int i, j;
+  for (i = 0; i < p->data.dfa.n; i++) {
+    for (j = 0; j < p->data.dfa.expected_num[i]; j++) {
+      free(p->data.dfa.expected[i][j]);
+    }
+    free(p->data.dfa.expected[i]);
+  }
+  free(p->data.dfa.expected);
+  free(p->data.dfa.expected_num);
+  free(p->data.dfa.table);
+  free(p->data.dfa.accept);
+  free(p->data.dfa.re);
+  
+}
+
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
   if (p->retained && !force) { return; }
@@ -1282,6 +1477,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA: mpc_undefine_dfa(p); break;
+    
     default: break;
   }
   
@@ -1942,21 +2139,15 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+/* Expand the body of a range from index i, after any leading '^', into its characters */
+static char *mpc_re_range_chars(const char *s, size_t i) {
   
-  mpc_parser_t *out;
   char *range = calloc(1,1);
   const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
   size_t start, end;
-  size_t i, j;
-  
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  size_t j;
   
-  for (i = comp; i < strlen(s); i++){
+  for (; i < strlen(s); i++){
     
     /* Regex Range Escape */
     if (s[i] == '\\') {
@@ -1997,6 +2188,21 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   }
   
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  char *range;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  range = mpc_re_range_chars(s, comp);
   out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
   
   free(x);
@@ -2005,12 +2211,403 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Most token regexes never need the backtracking
+** the combinators above provide. If at every point
+** each input character can only be matched by one
+** position of the regex, then the ordered choices
+** and greedy repeats never have a real choice to
+** make, and the regex can be compiled straight to
+** a table with one state per position (Glushkov's
+** construction). Tokens are then recognised with a
+** single lookup per character and no marks or
+** rewinds.
+**
+** Regexes that are not deterministic in this way,
+** or that use anchors, counts or zero width escapes,
+** are built from combinators as before.
+*/
+
+#define MPC_RE_DFA_MAX_POS 64
+
+typedef struct {
+  int nullable;
+  unsigned long long first;
+  unsigned long long last;
+} mpc_re_set_t;
+
+typedef struct {
+  const char *s;
+  int failed;
+  int npos;
+  unsigned char classes[MPC_RE_DFA_MAX_POS][32];
+  unsigned long long follow[MPC_RE_DFA_MAX_POS];
+  /* What the combinator for each position would say it expected */
+  char *desc[MPC_RE_DFA_MAX_POS];
+  /* Positions lo to hi of each '+' body, innermost first */
+  int nmany1;
+  int many1_lo[MPC_RE_DFA_MAX_POS];
+  int many1_hi[MPC_RE_DFA_MAX_POS];
+} mpc_re_dfa_t;
+
+static mpc_re_set_t mpc_re_dfa_empty(void) {
+  mpc_re_set_t x;
+  x.nullable = 1;
+  x.first = 0;
+  x.last = 0;
+  return x;
+}
+
+/* Every position in from may be followed by every position in to */
+static void mpc_re_dfa_link(mpc_re_dfa_t *c, unsigned long long from, unsigned long long to) {
+  int i;
+  for (i = 0; i < c->npos; i++) {
+    if ((from >> i) & 1) { c->follow[i] |= to; }
+  }
+}
+
+static void mpc_re_dfa_set(unsigned char *cls, char x) {
+  cls[(unsigned char)x / 8] |= 1 << ((unsigned char)x % 8);
+}
+
+/* Same characters as mpc_input_oneof, which also accepts '\0' */
+static void mpc_re_dfa_oneof(unsigned char *cls, const char *xs) {
+  mpc_re_dfa_set(cls, '\0');
+  while (*xs) { mpc_re_dfa_set(cls, *xs++); }
+}
+
+/* Same characters as mpc_input_noneof, which never accepts '\0' */
+static void mpc_re_dfa_noneof(unsigned char *cls, const char *xs) {
+  int i;
+  for (i = 1; i < 256; i++) {
+    if (!strchr(xs, i)) { mpc_re_dfa_set(cls, i); }
+  }
+}
+
+static char *mpc_re_dfa_desc(const char *fmt, const char *x) {
+  char *d = malloc(strlen(fmt) + strlen(x) + 1);
+  sprintf(d, fmt, x);
+  return d;
+}
+
+static mpc_re_set_t mpc_re_dfa_regex(mpc_re_dfa_t *c);
+
+static mpc_re_set_t mpc_re_dfa_base(mpc_re_dfa_t *c) {
+  
+  mpc_re_set_t x = mpc_re_dfa_empty();
+  unsigned char *cls;
+  const char *start;
+  char *body, *range;
+  char single[2] = { '\0', '\0' };
+  int p;
+  
+  if (*c->s == '(') {
+    c->s++;
+    x = mpc_re_dfa_regex(c);
+    if (*c->s != ')') { c->failed = 1; return x; }
+    c->s++;
+    return x;
+  }
+  
+  if (c->npos == MPC_RE_DFA_MAX_POS) { c->failed = 1; return x; }
+  p = c->npos++;
+  cls = c->classes[p];
+  x.nullable = 0;
+  x.first = 1ULL << p;
+  x.last = 1ULL << p;
+  
+  switch (*c->s) {
+    
+    case '[':
+      start = ++c->s;
+      while (*c->s && *c->s != ']') {
+        if (*c->s == '\\' && c->s[1]) { c->s++; }
+        c->s++;
+      }
+      if (*c->s != ']' || c->s == start || (c->s == start + 1 && *start == '^')) {
+        c->failed = 1;
+        return x;
+      }
+      body = calloc(c->s - start + 1, 1);
+      memcpy(body, start, c->s - start);
+      range = mpc_re_range_chars(body, body[0] == '^' ? 1 : 0);
+      if (body[0] == '^') { mpc_re_dfa_noneof(cls, range); }
+      else { mpc_re_dfa_oneof(cls, range); }
+      c->desc[p] = mpc_re_dfa_desc("one of '%s'", range);
+      free(body);
+      free(range);
+      c->s++;
+      return x;
+    
+    case '\\':
+      switch (c->s[1]) {
+        case 'a': single[0] = '\a'; break;
+        case 'f': single[0] = '\f'; break;
+        case 'n': single[0] = '\n'; break;
+        case 'r': single[0] = '\r'; break;
+        case 't': single[0] = '\t'; break;
+        case 'v': single[0] = '\v'; break;
+        case 'd':
+          mpc_re_dfa_oneof(cls, "0123456789");
+          c->desc[p] = mpc_re_dfa_desc("%s", "digit");
+          break;
+        case 's':
+          mpc_re_dfa_oneof(cls, " \f\n\r\t\v");
+          c->desc[p] = mpc_re_dfa_desc("%s", "whitespace");
+          break;
+        case 'w':
+          mpc_re_dfa_oneof(cls, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+          mpc_re_dfa_set(cls, '_');
+          c->desc[p] = mpc_re_dfa_desc("%s", "alphanumeric");
+          break;
+        case 'b': case 'B': case 'A': case 'Z':
+        case 'D': case 'S': case 'W': case '\0':
+          c->failed = 1;
+          return x;
+        default: single[0] = c->s[1]; break;
+      }
+      c->s += 2;
+      break;
+    
+    case '.':
+      mpc_re_dfa_noneof(cls, "");
+      mpc_re_dfa_set(cls, '\0');
+      c->desc[p] = mpc_re_dfa_desc("%s", "any character");
+      c->s++;
+      break;
+    
+    case '^': case '$': c->failed = 1; return x;
+    
+    default: single[0] = *c->s; c->s++; break;
+  }
+  
+  if (c->desc[p] == NULL) {
+    mpc_re_dfa_set(cls, single[0]);
+    c->desc[p] = mpc_re_dfa_desc("'%s'", single);
+  }
+  return x;
+}
+
+static mpc_re_set_t mpc_re_dfa_factor(mpc_re_dfa_t *c) {
+  
+  int lo = c->npos;
+  mpc_re_set_t x = mpc_re_dfa_base(c);
+  if (c->failed) { return x; }
+  
+  switch (*c->s) {
+    case '*':
+    case '+':
+      /* The combinators would repeat a body that matches nothing forever */
+      if (x.nullable) { c->failed = 1; return x; }
+      mpc_re_dfa_link(c, x.last, x.first);
+      if (*c->s == '+') {
+        c->many1_lo[c->nmany1] = lo;
+        c->many1_hi[c->nmany1] = c->npos;
+        c->nmany1++;
+      }
+      x.nullable = *c->s == '*';
+      c->s++;
+      break;
+    case '?': x.nullable = 1; c->s++; break;
+    case '{': c->failed = 1; break;
+  }
+  return x;
+}
+
+static mpc_re_set_t mpc_re_dfa_term(mpc_re_dfa_t *c) {
+  
+  mpc_re_set_t x = mpc_re_dfa_empty(), y;
+  
+  while (*c->s && *c->s != '|' && *c->s != ')' && !c->failed) {
+    y = mpc_re_dfa_factor(c);
+    mpc_re_dfa_link(c, x.last, y.first);
+    x.first = x.nullable ? x.first | y.first : x.first;
+    x.last = y.nullable ? x.last | y.last : y.last;
+    x.nullable = x.nullable && y.nullable;
+  }
+  return x;
+}
+
+static mpc_re_set_t mpc_re_dfa_regex(mpc_re_dfa_t *c) {
+  
+  mpc_re_set_t x = mpc_re_dfa_term(c), y;
+  
+  if (*c->s == '|' && !c->failed) {
+    /* Ordered choice would always take an empty left alternative */
+    if (x.nullable) { c->failed = 1; return x; }
+    c->s++;
+    y = mpc_re_dfa_regex(c);
+    x.nullable = y.nullable;
+    x.first |= y.first;
+    x.last |= y.last;
+  }
+  return x;
+}
+
+/* True if no character is matched by two of the positions in set */
+static int mpc_re_dfa_deterministic(mpc_re_dfa_t *c, unsigned long long set) {
+  int i, j, k;
+  for (i = 0; i < c->npos; i++) {
+    if (!((set >> i) & 1)) { continue; }
+    for (j = i + 1; j < c->npos; j++) {
+      if (!((set >> j) & 1)) { continue; }
+      for (k = 0; k < 32; k++) {
+        if (c->classes[i][k] & c->classes[j][k]) { return 0; }
+      }
+    }
+  }
+  return 1;
+}
+
+/* Join xs as mpc_err_repeat does, after the given prefix */
+static char *mpc_re_dfa_join(const char *prefix, char **xs, int n) {
+  
+  int i, len = strlen(prefix) + 1;
+  char *out;
+  
+  for (i = 0; i < n; i++) { len += strlen(xs[i]) + strlen(", "); }
+  out = malloc(len);
+  strcpy(out, prefix);
+  
+  for (i = 0; i < n; i++) {
+    strcat(out, xs[i]);
+    if (i < n - 2) { strcat(out, ", "); }
+    if (i == n - 2) { strcat(out, " or "); }
+  }
+  return out;
+}
+
+static int mpc_re_dfa_contains(char **xs, int n, const char *x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (strcmp(xs[i], x) == 0) { return 1; }
+  }
+  return 0;
+}
+
+/*
+** What the combinators would have expected after state s,
+** whose next positions are in next. Like mpc_err_many1, the
+** first iteration of a '+' body is reported as one item.
+*/
+static int mpc_re_dfa_expected(mpc_re_dfa_t *c, int s, unsigned long long next, char ***out) {
+  
+  char *items[MPC_RE_DFA_MAX_POS], *inner[MPC_RE_DFA_MAX_POS], *joined;
+  unsigned long long masks[MPC_RE_DFA_MAX_POS], body;
+  int i, j, k, n = 0, m, first, num = 0;
+  
+  for (i = 0; i < c->npos; i++) {
+    if ((next >> i) & 1) {
+      items[n] = mpc_re_dfa_desc("%s", c->desc[i]);
+      masks[n++] = 1ULL << i;
+    }
+  }
+  
+  for (i = 0; i < c->nmany1; i++) {
+    
+    /* Inside the body this is a later iteration, reported as it is */
+    if (s > c->many1_lo[i] && s <= c->many1_hi[i]) { continue; }
+    
+    body = 0;
+    for (j = c->many1_lo[i]; j < c->many1_hi[i]; j++) { body |= 1ULL << j; }
+    
+    m = 0;
+    first = -1;
+    for (j = 0; j < n; j++) {
+      if ((masks[j] & body) == 0) { continue; }
+      if (first < 0) { first = j; }
+      if (!mpc_re_dfa_contains(inner, m, items[j])) { inner[m++] = items[j]; }
+    }
+    if (first < 0) { continue; }
+    
+    joined = mpc_re_dfa_join("one or more of ", inner, m);
+    
+    for (j = first, k = first; j < n; j++) {
+      if (masks[j] & body) {
+        free(items[j]);
+        if (j == first) {
+          items[k] = joined;
+          masks[k++] = body;
+        }
+        continue;
+      }
+      items[k] = items[j];
+      masks[k++] = masks[j];
+    }
+    n = k;
+  }
+  
+  *out = malloc(sizeof(char*) * (n ? n : 1));
+  for (i = 0; i < n; i++) {
+    if (mpc_re_dfa_contains(*out, num, items[i])) { free(items[i]); }
+    else { (*out)[num++] = items[i]; }
+  }
+  return num;
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re) {
+  
+  mpc_re_dfa_t *c = calloc(1, sizeof(mpc_re_dfa_t));
+  mpc_re_set_t x;
+  mpc_parser_t *p;
+  unsigned long long next;
+  int i, j, k, n;
+  
+  c->s = re;
+  x = mpc_re_dfa_regex(c);
+  if (*c->s != '\0') { c->failed = 1; }
+  
+  if (!c->failed && !mpc_re_dfa_deterministic(c, x.first)) { c->failed = 1; }
+  for (i = 0; i < c->npos && !c->failed; i++) {
+    if (!mpc_re_dfa_deterministic(c, c->follow[i])) { c->failed = 1; }
+  }
+  
+  if (c->failed) {
+    for (i = 0; i < c->npos; i++) { free(c->desc[i]); }
+    free(c);
+    return NULL;
+  }
+  
+  /* State 0 is the start, state i+1 follows a match of position i */
+  n = c->npos + 1;
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.n = n;
+  p->data.dfa.table = malloc(sizeof(int) * n * 256);
+  p->data.dfa.accept = calloc(n, 1);
+  p->data.dfa.expected_num = malloc(sizeof(int) * n);
+  p->data.dfa.expected = malloc(sizeof(char**) * n);
+  p->data.dfa.re = malloc(strlen(re) + 1);
+  strcpy(p->data.dfa.re, re);
+  
+  for (i = 0; i < n; i++) {
+    next = (i == 0) ? x.first : c->follow[i-1];
+    for (k = 0; k < 256; k++) {
+      p->data.dfa.table[i * 256 + k] = -1;
+      for (j = 0; j < c->npos; j++) {
+        if (((next >> j) & 1) && (c->classes[j][k / 8] & (1 << (k % 8)))) {
+          p->data.dfa.table[i * 256 + k] = j + 1;
+        }
+      }
+    }
+    p->data.dfa.accept[i] = (i == 0) ? x.nullable : (char)((x.last >> (i-1)) & 1);
+    p->data.dfa.expected_num[i] = mpc_re_dfa_expected(c, i, next, &p->data.dfa.expected[i]);
+  }
+  
+  for (i = 0; i < c->npos; i++) { free(c->desc[i]); }
+  free(c);
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
   mpc_parser_t *err_out;
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  mpc_parser_t *dfa = mpc_re_dfa(re);
+  
+  if (dfa != NULL) { return dfa; }
   
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
@@ -2371,6 +2968,15 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA) {
+    s = mpcf_escape_new(
+      p->data.dfa.re,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("/%s/", s);
+    free(s);
+  }
+  
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
@@ -2513,6 +3119,7 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   strcpy(a->contents, contents);
   
   a->state = mpc_state_new();
+  a->kind = 0;
   
   a->children_num = 0;
   a->children = NULL;
@@ -2594,6 +3201,17 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   return a;
 }
 
+/* Sets the kind unless an inner rule has already set it */
+mpc_ast_t *mpc_ast_kind(mpc_ast_t *a, int kind) {
+  if (a == NULL) { return a; }
+  if (a->kind == 0) { a->kind = kind; }
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_kind_to(mpc_ast_t *a, void *kind) {
+  return mpc_ast_kind(a, (int)(size_t)kind);
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   
   int i;
@@ -2687,14 +3305,28 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
   return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
 }
 
+static mpc_parser_t *mpca_kind(mpc_parser_t *a, int kind) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_kind_to, (void*)(size_t)kind);
+}
+
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_many(mpcf_fold_ast, a);
+  p->data.repeat.dx = (mpc_dtor_t)mpc_ast_delete;
+  return p;
+}
+
+mpc_parser_t *mpca_many1(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_many1(mpcf_fold_ast, a);
+  p->data.repeat.dx = (mpc_dtor_t)mpc_ast_delete;
+  return p;
+}
+
 mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
 
 mpc_parser_t *mpca_or(int n, ...) {
@@ -2906,14 +3538,19 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
 
 static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
+  int i, kind = 0;
   mpca_grammar_st_t *st = s;
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
   free(x);
 
+  for (i = 0; i < st->parsers_num; i++) {
+    if (st->parsers[i] == p) { kind = i + 1; break; }
+  }
+
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpca_kind(mpca_add_tag(p, p->name), kind)));
   } else {
-    return mpca_state(mpca_root(p));
+    return mpca_state(mpca_root(mpca_kind(p, kind)));
   }
 }
 
@@ -0,0 +1,196 @@
+/*
+ *  Kernels for packed numeric arrays.
+ *
+ *  The loops are kept branch free with unit stride so the compiler can
+ *  vectorise them (this file is built with -O3). Integer kernels detect
+ *  overflow with the same rules as builtin_op instead of wrapping.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "narray.h"
+
+static int narray_add_long(long* r, const long* x, const long* y, int n) {
+    long ovf = 0;
+    for (int i = 0; i < n; i++) {
+        long s = (long)((unsigned long)x[i] + (unsigned long)y[i]);
+        /* Overflowed if the sign of the sum differs from both operands */
+        ovf |= (x[i] ^ s) & (y[i] ^ s);
+        r[i] = s;
+    }
+    return ovf < 0 ? NARRAY_OVERFLOW : NARRAY_OK;
+}
+
+static int narray_sub_long(long* r, const long* x, const long* y, int n) {
+    long ovf = 0;
+    for (int i = 0; i < n; i++) {
+        long s = (long)((unsigned long)x[i] - (unsigned long)y[i]);
+        ovf |= (x[i] ^ y[i]) & (x[i] ^ s);
+        r[i] = s;
+    }
+    return ovf < 0 ? NARRAY_OVERFLOW : NARRAY_OK;
+}
+
+static int narray_mul_long(long* r, const long* x, const long* y, int n) {
+    int ovf = 0;
+    for (int i = 0; i < n; i++) {
+        /* Through a temporary, as r may alias x */
+        long p;
+        ovf |= __builtin_mul_overflow(x[i], y[i], &p);
+        r[i] = p;
+    }
+    return ovf ? NARRAY_OVERFLOW : NARRAY_OK;
+}
+
+static int narray_div_long(char op, long* r, const long* x, const long* y, int n) {
+    for (int i = 0; i < n; i++) {
+        if (y[i] == 0) { return NARRAY_DIV_ZERO; }
+        if (op == '/' && x[i] == LONG_MIN && y[i] == -1) { return NARRAY_OVERFLOW; }
+    }
+    for (int i = 0; i < n; i++) {
+        if (y[i] == -1) {
+            /* Avoids trapping on LONG_MIN % -1 */
+            r[i] = (op == '/') ? -x[i] : 0;
+        } else {
+            r[i] = (op == '/') ? x[i] / y[i] : x[i] % y[i];
+        }
+    }
+    return NARRAY_OK;
+}
+
+int narray_op_long(char op, long* r, const long* x, const long* y, int n) {
+    switch (op) {
+        case '+': return narray_add_long(r, x, y, n);
+        case '-': return narray_sub_long(r, x, y, n);
+        case '*': return narray_mul_long(r, x, y, n);
+        case '/':
+        case '%': return narray_div_long(op, r, x, y, n);
+    }
+    return NARRAY_OK;
+}
+
+int narray_op_double(char op, double* r, const double* x, const double* y, int n) {
+    if (op == '/' || op == '%') {
+        for (int i = 0; i < n; i++) {
+            if (y[i] == 0) { return NARRAY_DIV_ZERO; }
+        }
+    }
+
+    switch (op) {
+        case '+': for (int i = 0; i < n; i++) { r[i] = x[i] + y[i]; } break;
+        case '-': for (int i = 0; i < n; i++) { r[i] = x[i] - y[i]; } break;
+        case '*': for (int i = 0; i < n; i++) { r[i] = x[i] * y[i]; } break;
+        case '/': for (int i = 0; i < n; i++) { r[i] = x[i] / y[i]; } break;
+        case '%': for (int i = 0; i < n; i++) { r[i] = __builtin_fmod(x[i], y[i]); } break;
+    }
+    return NARRAY_OK;
+}
+
+void narray_cmp_long(char* op, long* r, const long* x, const long* y, int n) {
+    if (strcmp(op, ">") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] > y[i]; }
+    }
+    if (strcmp(op, "<") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] < y[i]; }
+    }
+    if (strcmp(op, ">=") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] >= y[i]; }
+    }
+    if (strcmp(op, "<=") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] <= y[i]; }
+    }
+}
+
+void narray_cmp_double(char* op, long* r, const double* x, const double* y, int n) {
+    if (strcmp(op, ">") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] > y[i]; }
+    }
+    if (strcmp(op, "<") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] < y[i]; }
+    }
+    if (strcmp(op, ">=") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] >= y[i]; }
+    }
+    if (strcmp(op, "<=") == 0) {
+        for (int i = 0; i < n; i++) { r[i] = x[i] <= y[i]; }
+    }
+}
+
+int narray_reduce_long(char op, const long* x, int n, long* out) {
+    long acc;
+
+    switch (op) {
+        case '+':
+            {
+                /* If no partial sum can leave the range of long, sum without checks */
+                unsigned long max = 0;
+                for (int i = 0; i < n; i++) {
+                    unsigned long m = x[i] < 0 ? -(unsigned long)x[i] : (unsigned long)x[i];
+                    max = m > max ? m : max;
+                }
+                acc = 0;
+                if (n == 0 || max <= LONG_MAX / (unsigned long)n) {
+                    for (int i = 0; i < n; i++) { acc += x[i]; }
+                } else {
+                    for (int i = 0; i < n; i++) {
+                        if (__builtin_add_overflow(acc, x[i], &acc)) { return NARRAY_OVERFLOW; }
+                    }
+                }
+            }
+            break;
+        case '*':
+            acc = 1;
+            for (int i = 0; i < n; i++) {
+                if (__builtin_mul_overflow(acc, x[i], &acc)) { return NARRAY_OVERFLOW; }
+            }
+            break;
+        case '<':
+            acc = x[0];
+            for (int i = 1; i < n; i++) { acc = x[i] < acc ? x[i] : acc; }
+            break;
+        case '>':
+            acc = x[0];
+            for (int i = 1; i < n; i++) { acc = x[i] > acc ? x[i] : acc; }
+            break;
+        default:
+            acc = 0;
+    }
+    *out = acc;
+    return NARRAY_OK;
+}
+
+void narray_reduce_double(char op, const double* x, int n, double* out) {
+    /* Four independent accumulators so the additions can run in parallel */
+    double a0, a1, a2, a3;
+    int i = 0;
+
+    switch (op) {
+        case '+':
+            a0 = a1 = a2 = a3 = 0;
+            for (; i + 4 <= n; i += 4) {
+                a0 += x[i]; a1 += x[i+1]; a2 += x[i+2]; a3 += x[i+3];
+            }
+            for (; i < n; i++) { a0 += x[i]; }
+            *out = (a0 + a1) + (a2 + a3);
+            break;
+        case '*':
+            a0 = a1 = a2 = a3 = 1;
+            for (; i + 4 <= n; i += 4) {
+                a0 *= x[i]; a1 *= x[i+1]; a2 *= x[i+2]; a3 *= x[i+3];
+            }
+            for (; i < n; i++) { a0 *= x[i]; }
+            *out = (a0 * a1) * (a2 * a3);
+            break;
+        case '<':
+            a0 = x[0];
+            for (i = 1; i < n; i++) { a0 = x[i] < a0 ? x[i] : a0; }
+            *out = a0;
+            break;
+        case '>':
+            a0 = x[0];
+            for (i = 1; i < n; i++) { a0 = x[i] > a0 ? x[i] : a0; }
+            *out = a0;
+            break;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef narray
+#define narray
+
+/* Result codes for the packed array kernels */
+enum { NARRAY_OK, NARRAY_OVERFLOW, NARRAY_DIV_ZERO };
+
+/* Element-wise arithmatic, r[i] = x[i] op y[i]. r may be the same buffer as x. */
+int narray_op_long(char op, long* r, const long* x, const long* y, int n);
+int narray_op_double(char op, double* r, const double* x, const double* y, int n);
+
+/* Element-wise comparison, r[i] = x[i] op y[i] as 0 or 1 */
+void narray_cmp_long(char* op, long* r, const long* x, const long* y, int n);
+void narray_cmp_double(char* op, long* r, const double* x, const double* y, int n);
+
+/* Reductions. op is '+' (sum), '*' (product), '<' (min) or '>' (max) */
+int narray_reduce_long(char op, const long* x, int n, long* out);
+void narray_reduce_double(char op, const double* x, int n, double* out);
+
+#endif
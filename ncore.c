@@ -8,10 +8,15 @@
 #include "builtins.h"
 #include "mpc.h"
 #include "mempool.h"
+#include "nprofile.h"
+#include "ntrace.h"
+
+nmetrics nval_metrics;
 
 /* Constuctor and destructor for environment types */
 nenv* nenv_new(void) {
     nenv* e = malloc(sizeof(nenv));
+    POOL_PROFILE_MALLOC(sizeof(nenv));
     e->par = NULL;
     e->count = 0;
     e->syms = NULL;
@@ -33,19 +38,44 @@ void nenv_del(nenv* e) {
 
 /* Environment manipulation functions */
 nval* nenv_get(nenv* e, nval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return nval_copy(e->vals[i]);
-        }
-    }
+    nval_metrics.lookups++;
 
     /* Check all parent environments if symbol not found */
-    if (e->par) {
-        return nenv_get(e->par, k);
+    for (long depth = 1; e; e = e->par, depth++) {
+        nval_metrics.lookup_depth++;
+        if (depth > nval_metrics.lookup_depth_max) { nval_metrics.lookup_depth_max = depth; }
+
+        for (int i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], k->sym) == 0) {
+                return nval_copy(e->vals[i]);
+            }
+        }
     }
     return nval_err("Symbol '%s' not declared", k->sym);
 }
 
+/* Value a symbol refers to from e if that is a protected global, still owned by the
+ * environment. NULL if unbound, not protected, or shadowed by a binding in a scope below the globals */
+nval* nenv_get_protected(nenv* e, nval* k) {
+    for (; e; e = e->par) {
+        for (int i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], k->sym) == 0) {
+                return (e->par == NULL && e->protected[i]) ? e->vals[i] : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Whether k is bound to a protected global. Such names cannot be bound anywhere else */
+bool nenv_is_protected(nenv* e, nval* k) {
+    while (e->par) { e = e->par; }
+    for (int i = 0; i < e->count; i++) {
+        if (strcmp(e->syms[i], k->sym) == 0) { return e->protected[i]; }
+    }
+    return false;
+}
+
 bool nenv_add_val(nenv* e, nval* k, nval* v, bool p) {
     /* Check if variable already exists */
     for (int i = 0; i < e->count; i++) {
@@ -66,9 +96,13 @@ bool nenv_add_val(nenv* e, nval* k, nval* v, bool p) {
     e->vals = realloc(e->vals, sizeof(nval*) * e->count);
     e->syms = realloc(e->syms, sizeof(char*) * e->count);
     e->protected = realloc(e->protected, sizeof(bool) * e->count);
+    POOL_PROFILE_MALLOC(sizeof(nval*) * e->count);
+    POOL_PROFILE_MALLOC(sizeof(char*) * e->count);
+    POOL_PROFILE_MALLOC(sizeof(bool) * e->count);
 
     e->vals[e->count-1] = nval_copy(v);
     e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+    POOL_PROFILE_MALLOC(strlen(k->sym)+1);
     if (p) { e->protected[e->count-1] = true; }
     else { e->protected[e->count-1] = false; }
     strcpy(e->syms[e->count-1], k->sym);
@@ -110,13 +144,19 @@ void nenv_rem(nenv* e, nval* k) {
 
 nenv* nenv_copy(nenv* e) {
     nenv* n = malloc(sizeof(nenv));
+    POOL_PROFILE_MALLOC(sizeof(nenv));
     n->par = e->par;
     n->count = e->count;
     if (e->count > 0) {
         n->syms = malloc(sizeof(char*) * n->count);
         n->vals = malloc(sizeof(nval*) * n->count);
+        n->protected = malloc(sizeof(bool) * n->count);
+        POOL_PROFILE_MALLOC(sizeof(char*) * n->count);
+        POOL_PROFILE_MALLOC(sizeof(nval*) * n->count);
+        POOL_PROFILE_MALLOC(sizeof(bool) * n->count);
         for (int i = 0; i < e->count; i++) {
             n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+            POOL_PROFILE_MALLOC(strlen(e->syms[i]) + 1);
             strcpy(n->syms[i], e->syms[i]);
             n->vals[i] = nval_copy(e->vals[i]);
             n->protected[i] = e->protected[i];
@@ -158,6 +198,7 @@ nval* nval_double(double x) {
 nval* nval_err(char* fmt, ...) {
     nval* v = nmalloc();
     v->type = NVAL_ERR;
+    nval_metrics.errors++;
 
     /* Create a va list and initialize it */
     va_list va;
@@ -165,6 +206,7 @@ nval* nval_err(char* fmt, ...) {
 
     /* Allocate 512 bytes of space */
     v->err = malloc(512);
+    POOL_PROFILE_MALLOC(512);
 
     /* printf the error string with a maximum of 511 characters */
     vsnprintf(v->err, 511, fmt, va);
@@ -182,6 +224,7 @@ nval* nval_sym(char* s) {
     nval* v = nmalloc();
     v->type = NVAL_SYM;
     v->sym = malloc(strlen(s) + 1);
+    POOL_PROFILE_MALLOC(strlen(s) + 1);
     strcpy(v->sym, s);
     return v;
 }
@@ -202,10 +245,15 @@ nval* nval_qexpr(void) {
     return v;
 }
 
+/* Last id given to a function */
+static long nval_last_id = 0;
+
 nval* nval_fun(nbuiltin func) {
     nval* v = nmalloc();
     v->type = NVAL_FUN;
     v->builtin = func;
+    v->name = NULL;
+    v->id = ++nval_last_id;
     return v;
 }
 
@@ -219,6 +267,8 @@ nval* nval_lambda(nval* formals, nval* body) {
     nval* v = nmalloc();
     v->type = NVAL_FUN;
     v->builtin = NULL;
+    v->name = NULL;
+    v->id = ++nval_last_id;
     v->env = nenv_new();
     v->formals = formals;
     v->body = body;
@@ -229,6 +279,7 @@ nval* nval_str(char* s) {
     nval* v = nmalloc();
     v->type = NVAL_STR;
     v->str = malloc(strlen(s)+1);
+    POOL_PROFILE_MALLOC(strlen(s)+1);
     strcpy(v->str, s);
     return v;
 }
@@ -253,6 +304,53 @@ nval* nval_quit(long x) {
     return v;
 }
 
+nval* nval_array(int arr_type, int count) {
+    nval* v = nmalloc();
+    v->type = NVAL_ARRAY;
+    v->arr_type = arr_type;
+    v->count = count;
+    v->nums = NULL;
+    v->doubs = NULL;
+    if (arr_type == NVAL_DOUBLE) {
+        v->doubs = calloc(count ? count : 1, sizeof(double));
+        POOL_PROFILE_MALLOC(sizeof(double) * (count ? count : 1));
+    } else {
+        v->nums = calloc(count ? count : 1, sizeof(long));
+        POOL_PROFILE_MALLOC(sizeof(long) * (count ? count : 1));
+    }
+    return v;
+}
+
+nval* nval_vec(void) {
+    nval* v = nmalloc();
+    v->type = NVAL_VEC;
+    v->vec = malloc(sizeof(nvec));
+    POOL_PROFILE_MALLOC(sizeof(nvec));
+    v->vec->refs = 1;
+    v->vec->count = 0;
+    v->vec->capacity = 0;
+    v->vec->items = NULL;
+    v->vec_start = 0;
+    v->vec_end = -1;
+    return v;
+}
+
+nval* nval_map(void) {
+    nval* v = nmalloc();
+    v->type = NVAL_MAP;
+    v->map = malloc(sizeof(nmap));
+    POOL_PROFILE_MALLOC(sizeof(nmap));
+    v->map->refs = 1;
+    v->map->count = 0;
+    v->map->used = 0;
+    v->map->capacity = 8;
+    v->map->keys = calloc(v->map->capacity, sizeof(nval*));
+    v->map->vals = calloc(v->map->capacity, sizeof(nval*));
+    POOL_PROFILE_MALLOC(sizeof(nval*) * v->map->capacity);
+    POOL_PROFILE_MALLOC(sizeof(nval*) * v->map->capacity);
+    return v;
+}
+
 /* nval manipulation functions */
 void nval_del(nval* v) {
     switch (v->type) {
@@ -266,6 +364,32 @@ void nval_del(nval* v) {
         case NVAL_ERR: free(v->err); break;
         case NVAL_SYM: free(v->sym); break;
         case NVAL_STR: free(v->str); break;
+        case NVAL_ARRAY: free(v->nums); free(v->doubs); break;
+
+        /* Vectors share their storage, delete it with the last view */
+        case NVAL_VEC:
+            v->vec->refs--;
+            if (v->vec->refs == 0) {
+                for (int i = 0; i < v->vec->count; i++) {
+                    nval_del(v->vec->items[i]);
+                }
+                free(v->vec->items);
+                free(v->vec);
+            }
+        break;
+
+        case NVAL_MAP:
+            v->map->refs--;
+            if (v->map->refs == 0) {
+                for (int i = nval_map_next(v, 0); i != -1; i = nval_map_next(v, i+1)) {
+                    nval_del(v->map->keys[i]);
+                    nval_del(v->map->vals[i]);
+                }
+                free(v->map->keys);
+                free(v->map->vals);
+                free(v->map);
+            }
+        break;
 
         /* S/Q-expression, delete all elements inside */
         case NVAL_QEXPR:
@@ -293,6 +417,7 @@ void nval_del(nval* v) {
 nval* nval_add(nval* v, nval* x) {
     v->count++;
     v->cell = realloc(v->cell, sizeof(nval*) * v->count);
+    POOL_PROFILE_MALLOC(sizeof(nval*) * v->count);
     v->cell[v->count-1] = x;
     return v;
 }
@@ -322,34 +447,73 @@ nval* nval_join(nval* x, nval* y) {
 nval* nval_copy(nval* v) {
     nval* x = nmalloc();
     x->type = v->type;
+    nval_metrics.copies++;
+    nval_metrics.copy_bytes += sizeof(nval);
 
     switch (v->type) {
         case NVAL_EMPTY: break;
         case NVAL_NUM: x->num = v->num; break;
         case NVAL_DOUBLE: x->doub = v->doub; break;
         case NVAL_OK:  x->ok = v->ok; break;
-        case NVAL_FUN_MACRO: x->builtin = v->builtin; break;
+        case NVAL_FUN_MACRO: x->builtin = v->builtin; x->name = v->name; x->id = v->id; break;
 
         case NVAL_ERR:
-            x->err = malloc(strlen(v->err)+1);
-            strcpy(x->err, v->err); break;
         case NVAL_SYM:
-            x->sym = malloc(strlen(v->sym)+1);
-            strcpy(x->sym, v->sym); break;
-        case NVAL_STR:
-            x->str = malloc(strlen(v->str)+1);
-            strcpy(x->str, v->str); break;
+        case NVAL_STR: {
+            char* text = v->type == NVAL_ERR ? v->err : v->type == NVAL_SYM ? v->sym : v->str;
+            size_t n = strlen(text) + 1;
+            char* copy = malloc(n);
+            memcpy(copy, text, n);
+            if (v->type == NVAL_ERR) { x->err = copy; }
+            else if (v->type == NVAL_SYM) { x->sym = copy; }
+            else { x->str = copy; }
+            POOL_PROFILE_MALLOC(n);
+            nval_metrics.copy_bytes += n;
+        }
+        break;
+
+        case NVAL_ARRAY:
+            x->arr_type = v->arr_type;
+            x->count = v->count;
+            x->nums = NULL;
+            x->doubs = NULL;
+            if (v->arr_type == NVAL_DOUBLE) {
+                x->doubs = malloc(sizeof(double) * (x->count ? x->count : 1));
+                POOL_PROFILE_MALLOC(sizeof(double) * (x->count ? x->count : 1));
+                memcpy(x->doubs, v->doubs, sizeof(double) * x->count);
+            } else {
+                x->nums = malloc(sizeof(long) * (x->count ? x->count : 1));
+                POOL_PROFILE_MALLOC(sizeof(long) * (x->count ? x->count : 1));
+                memcpy(x->nums, v->nums, sizeof(long) * x->count);
+            }
+        break;
+
+        case NVAL_VEC:
+            x->vec = v->vec;
+            x->vec->refs++;
+            x->vec_start = v->vec_start;
+            x->vec_end = v->vec_end;
+        break;
+
+        case NVAL_MAP:
+            x->map = v->map;
+            x->map->refs++;
+        break;
 
         case NVAL_SEXPR:
         case NVAL_QEXPR:
             x->count = v->count;
             x->cell = malloc(sizeof(nval*) * x->count);
+            POOL_PROFILE_MALLOC(sizeof(nval*) * x->count);
+            nval_metrics.copy_bytes += sizeof(nval*) * x->count;
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = nval_copy(v->cell[i]);
             }
         break;
 
         case NVAL_FUN:
+            x->name = v->name;
+            x->id = v->id;
             if (v->builtin) {
                 x->builtin = v->builtin;
             } else {
@@ -363,6 +527,202 @@ nval* nval_copy(nval* v) {
     return x;
 }
 
+/* Number of elements seen through a vector view */
+int nval_vec_len(nval* v) {
+    if (v->vec_end == -1) {
+        return v->vec->count - v->vec_start;
+    }
+    return v->vec_end - v->vec_start;
+}
+
+/* First element seen through a vector view */
+nval** nval_vec_items(nval* v) {
+    return v->vec->items + v->vec_start;
+}
+
+/* Append x to the shared storage of a whole vector view, growing it geometrically */
+void nval_vec_push(nval* v, nval* x) {
+    nvec* vec = v->vec;
+    if (vec->count == vec->capacity) {
+        vec->capacity = vec->capacity ? vec->capacity * 2 : 8;
+        vec->items = realloc(vec->items, sizeof(nval*) * vec->capacity);
+        POOL_PROFILE_MALLOC(sizeof(nval*) * vec->capacity);
+    }
+    vec->items[vec->count++] = x;
+}
+
+static bool nenv_reaches(nenv* e, void* storage) {
+    for (int i = 0; i < e->count; i++) {
+        if (nval_reaches(e->vals[i], storage)) { return true; }
+    }
+    return false;
+}
+
+/* Whether v is or holds, at any depth, a view of the given nvec or nmap.
+ * Storing such a value into that storage would make it contain itself */
+bool nval_reaches(nval* v, void* storage) {
+    switch (v->type) {
+        case NVAL_SEXPR:
+        case NVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (nval_reaches(v->cell[i], storage)) { return true; }
+            }
+        break;
+
+        case NVAL_VEC:
+            if (v->vec == storage) { return true; }
+            for (int i = 0; i < v->vec->count; i++) {
+                if (nval_reaches(v->vec->items[i], storage)) { return true; }
+            }
+        break;
+
+        case NVAL_MAP:
+            if (v->map == storage) { return true; }
+            for (int i = nval_map_next(v, 0); i != -1; i = nval_map_next(v, i+1)) {
+                if (nval_reaches(v->map->vals[i], storage)) { return true; }
+            }
+        break;
+
+        case NVAL_FUN:
+            if (!v->builtin) {
+                return nval_reaches(v->body, storage) || nenv_reaches(v->env, storage);
+            }
+        break;
+    }
+    return false;
+}
+
+/* Marks a deleted slot so probing continues past it */
+static nval nmap_tombstone;
+
+bool nval_map_key_ok(nval* k) {
+    return k->type == NVAL_NUM || k->type == NVAL_SYM || k->type == NVAL_STR;
+}
+
+static unsigned long nval_map_hash(nval* k) {
+    unsigned long h;
+    if (k->type == NVAL_NUM) {
+        h = (unsigned long)k->num * 0x9E3779B97F4A7C15UL;
+        return h ^ (h >> 29);
+    }
+
+    /* FNV-1a over the string, seeded by type so symbol a and string "a" differ */
+    char* c = (k->type == NVAL_SYM) ? k->sym : k->str;
+    h = 14695981039346656037UL ^ k->type;
+    while (*c) {
+        h ^= (unsigned char)*c++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static bool nval_map_key_eq(nval* x, nval* y) {
+    if (x->type != y->type) { return false; }
+    switch (x->type) {
+        case NVAL_NUM: return x->num == y->num;
+        case NVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+        case NVAL_STR: return strcmp(x->str, y->str) == 0;
+    }
+    return false;
+}
+
+/* Slot holding k, or the slot it should be inserted into if absent */
+static int nval_map_slot(nmap* m, nval* k, bool* found) {
+    int mask = m->capacity - 1;
+    int i = nval_map_hash(k) & mask;
+    int tomb = -1;
+
+    while (m->keys[i]) {
+        if (m->keys[i] == &nmap_tombstone) {
+            if (tomb == -1) { tomb = i; }
+        } else if (nval_map_key_eq(m->keys[i], k)) {
+            *found = true;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    *found = false;
+    return tomb != -1 ? tomb : i;
+}
+
+static void nval_map_resize(nmap* m, int capacity) {
+    nval** keys = m->keys;
+    nval** vals = m->vals;
+    int old = m->capacity;
+
+    m->capacity = capacity;
+    m->keys = calloc(capacity, sizeof(nval*));
+    m->vals = calloc(capacity, sizeof(nval*));
+    POOL_PROFILE_MALLOC(sizeof(nval*) * capacity);
+    POOL_PROFILE_MALLOC(sizeof(nval*) * capacity);
+    m->used = m->count;
+
+    for (int i = 0; i < old; i++) {
+        if (keys[i] && keys[i] != &nmap_tombstone) {
+            bool found;
+            int j = nval_map_slot(m, keys[i], &found);
+            m->keys[j] = keys[i];
+            m->vals[j] = vals[i];
+        }
+    }
+    free(keys);
+    free(vals);
+}
+
+/* Value stored under k, still owned by the map. NULL if absent */
+nval* nval_map_get(nval* m, nval* k) {
+    bool found;
+    int i = nval_map_slot(m->map, k, &found);
+    return found ? m->map->vals[i] : NULL;
+}
+
+/* Store v under k, taking ownership of both */
+void nval_map_put(nval* m, nval* k, nval* v) {
+    nmap* map = m->map;
+    bool found;
+    int i = nval_map_slot(map, k, &found);
+
+    if (found) {
+        nval_del(k);
+        nval_del(map->vals[i]);
+        map->vals[i] = v;
+        return;
+    }
+
+    if (!map->keys[i]) { map->used++; }
+    map->keys[i] = k;
+    map->vals[i] = v;
+    map->count++;
+
+    /* Keep the load factor, tombstones included, under 3/4 */
+    if (map->used * 4 > map->capacity * 3) {
+        nval_map_resize(map, map->count * 2 > map->capacity ? map->capacity * 2 : map->capacity);
+    }
+}
+
+bool nval_map_del(nval* m, nval* k) {
+    bool found;
+    int i = nval_map_slot(m->map, k, &found);
+    if (!found) { return false; }
+
+    nval_del(m->map->keys[i]);
+    nval_del(m->map->vals[i]);
+    m->map->keys[i] = &nmap_tombstone;
+    m->map->vals[i] = NULL;
+    m->map->count--;
+    return true;
+}
+
+/* Index of the first live slot at or after i, -1 when there are no more */
+int nval_map_next(nval* m, int i) {
+    for (; i < m->map->capacity; i++) {
+        if (m->map->keys[i] && m->map->keys[i] != &nmap_tombstone) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 char* ntype_name(int t) {
     switch(t) {
         case NVAL_FUN: return "Function";
@@ -377,6 +737,9 @@ char* ntype_name(int t) {
         case NVAL_OK: return "Ok";
         case NVAL_EMPTY: return "Empty";
         case NVAL_QUIT: return "Exit command";
+        case NVAL_ARRAY: return "Array";
+        case NVAL_VEC: return "Vector";
+        case NVAL_MAP: return "Map";
         default: return "Unknown";
     }
 }
@@ -399,6 +762,9 @@ void nval_print(nval* v) {
         case NVAL_SEXPR: nval_expr_print(v, '(', ')'); break;
         case NVAL_QEXPR: nval_expr_print(v, '{', '}'); break;
         case NVAL_STR: nval_print_str(v); break;
+        case NVAL_ARRAY: nval_print_array(v); break;
+        case NVAL_VEC: nval_print_vec(v); break;
+        case NVAL_MAP: nval_print_map(v); break;
         case NVAL_FUN_MACRO:
             if (v->builtin) {
                 printf("<macro>");
@@ -442,8 +808,77 @@ void nval_print_str(nval* v) {
     free(escaped);
 }
 
+void nval_print_array(nval* v) {
+    printf("#[");
+    for (int i = 0; i < v->count; i++) {
+        if (v->arr_type == NVAL_DOUBLE) {
+            printf("%f", v->doubs[i]);
+        } else {
+            printf("%li", v->nums[i]);
+        }
+
+        if (i != (v->count-1)) {
+            putchar(' ');
+        }
+    }
+    putchar(']');
+}
+
+void nval_print_vec(nval* v) {
+    int len = nval_vec_len(v);
+    nval** items = nval_vec_items(v);
+
+    putchar('[');
+    for (int i = 0; i < len; i++) {
+        nval_print(items[i]);
+
+        if (i != (len-1)) {
+            putchar(' ');
+        }
+    }
+    putchar(']');
+}
+
+void nval_print_map(nval* v) {
+    printf("#{");
+    for (int i = nval_map_next(v, 0); i != -1; ) {
+        nval_print(v->map->keys[i]);
+        putchar(' ');
+        nval_print(v->map->vals[i]);
+
+        i = nval_map_next(v, i+1);
+        if (i != -1) {
+            printf(", ");
+        }
+    }
+    putchar('}');
+}
+
+static void nval_metrics_put(nval* m, char* name, long x) {
+    nval_map_put(m, nval_str(name), nval_num(x));
+}
+
+nval* nval_metrics_map(void) {
+    memory_pool_counts pool = pool_counts();
+    nval* m = nval_map();
+    nval_metrics_put(m, "evals", nval_metrics.evals);
+    nval_metrics_put(m, "calls", nval_metrics.calls);
+    nval_metrics_put(m, "lookups", nval_metrics.lookups);
+    nval_metrics_put(m, "lookup-depth", nval_metrics.lookup_depth);
+    nval_metrics_put(m, "lookup-depth-max", nval_metrics.lookup_depth_max);
+    nval_metrics_put(m, "copies", nval_metrics.copies);
+    nval_metrics_put(m, "copy-bytes", nval_metrics.copy_bytes);
+    nval_metrics_put(m, "errors", nval_metrics.errors);
+    nval_metrics_put(m, "allocations", pool.allocations);
+    nval_metrics_put(m, "frees", pool.frees);
+    nval_metrics_put(m, "live", pool.live);
+    nval_metrics_put(m, "pool-growths", pool.pools);
+    return m;
+}
+
 /* Code evaluation functions */
 nval* nval_eval(nenv* e, nval* v) {
+    nval_metrics.evals++;
     if (v->type == NVAL_SYM) {
         nval* x = nenv_get(e, v);
         nval_del(v);
@@ -492,8 +927,7 @@ nval* nval_eval_sexpr(nenv* e, nval* v) {
     return result;
 }
 
-nval* nval_call(nenv* e, nval* f, nval* a) {
-    if (f->builtin) { return f->builtin(e, a); }
+static nval* nval_call_lambda(nenv* e, nval* f, nval* a) {
 
     int given = a->count;
     int total = f->formals->count;
@@ -546,3 +980,17 @@ nval* nval_call(nenv* e, nval* f, nval* a) {
         return nval_copy(f);
     }
 }
+
+/* Every call goes through here, so the profiler and tracer see the Nitrogen call stack */
+nval* nval_call(nenv* e, nval* f, nval* a) {
+    nval_metrics.calls++;
+    nprofile_enter(f);
+    char* name = f->name ? f->name : "lambda";
+    if (ntrace_on) { ntrace_begin(NTRACE_CALL, name); }
+
+    nval* result = f->builtin ? f->builtin(e, a) : nval_call_lambda(e, f, a);
+
+    if (ntrace_on) { ntrace_end(NTRACE_CALL, name); }
+    nprofile_exit();
+    return result;
+}
@@ -30,13 +30,21 @@
 
 struct nval;
 struct nenv;
+struct nvec;
+struct nmap;
 typedef struct nval nval;
 typedef struct nenv nenv;
+typedef struct nvec nvec;
+typedef struct nmap nmap;
 
 enum { NVAL_NUM, NVAL_DOUBLE, NVAL_ERR, NVAL_SYM, NVAL_STR,
        NVAL_SEXPR, NVAL_QEXPR, NVAL_FUN, NVAL_FUN_MACRO,
-       NVAL_OK, NVAL_EMPTY, NVAL_QUIT };
+       NVAL_OK, NVAL_EMPTY, NVAL_QUIT, NVAL_ARRAY, NVAL_VEC, NVAL_MAP };
 /* Notes: NVAL_QUIT is a special type that when encountered will stop execution and close the interpreter. It holds no value. */
+/* NVAL_ARRAY is a packed array of count numbers. arr_type is NVAL_NUM (stored in nums) or NVAL_DOUBLE (stored in doubs). */
+/* NVAL_VEC is a view onto a shared, reference counted nvec. Copies share the storage so vec-set! and vec-push!
+   are seen through every copy. vec_end is -1 for a view of the whole vector and an index for a slice. */
+/* NVAL_MAP is a hash map keyed by numbers, symbols and strings. Like vectors, copies share the nmap. */
 
 typedef nval*(*nbuiltin)(nenv*, nval*);
 
@@ -50,6 +58,11 @@ struct nval {
     char* str;
 
     nbuiltin builtin;
+    /* Name a function was defined with, shared through nprofile_intern. NULL for anonymous lambdas */
+    char* name;
+    /* Given to each function when it is made and kept by its copies, so
+     * functions that share a name are still told apart */
+    long id;
     nenv* env;
     nval* formals;
     nval* body;
@@ -57,6 +70,33 @@ struct nval {
 
     int count;
     nval** cell;
+
+    int arr_type;
+    long* nums;
+    double* doubs;
+
+    nvec* vec;
+    int vec_start;
+    int vec_end;
+
+    nmap* map;
+};
+
+struct nvec {
+    int refs;
+    int count;
+    int capacity;
+    nval** items;
+};
+
+/* Open addressing table, capacity is always a power of two. used counts live keys and tombstones. */
+struct nmap {
+    int refs;
+    int count;
+    int used;
+    int capacity;
+    nval** keys;
+    nval** vals;
 };
 
 struct nenv {
@@ -66,12 +106,32 @@ struct nenv {
     nval** vals;
     bool* protected;
 };
+/* Evaluator events since startup, always counted */
+typedef struct nmetrics {
+    long evals;
+    long calls;
+    long lookups;
+    /* Environments searched by all lookups, and by the longest one */
+    long lookup_depth;
+    long lookup_depth_max;
+    long copies;
+    long copy_bytes;
+    long errors;
+} nmetrics;
+
+extern nmetrics nval_metrics;
+
+/* Counters as a map from their names, with the memory pool's counts */
+nval* nval_metrics_map(void);
+
 /* Constuctor and destructor for environment types */
 nenv* nenv_new(void);
 void nenv_del(nenv* e);
 
 /* environment manipulation functions */
 nval* nenv_get(nenv* e, nval* k);
+nval* nenv_get_protected(nenv* e, nval* k);
+bool nenv_is_protected(nenv* e, nval* k);
 bool nenv_add_val(nenv* e, nval* k, nval* v, bool p);
 bool nenv_put(nenv* e, nval* k, nval* v);
 bool nenv_put_protected(nenv* e, nval* k, nval* v);
@@ -94,6 +154,9 @@ nval* nval_str(char* s);
 nval* nval_ok(void);
 nval* nval_empty(void);
 nval* nval_quit(long x);
+nval* nval_array(int arr_type, int count);
+nval* nval_vec(void);
+nval* nval_map(void);
 
 /* nval manipulation functions */
 void nval_del(nval* v);
@@ -102,6 +165,15 @@ nval* nval_pop(nval* v, int i);
 nval* nval_take(nval* v, int i);
 nval* nval_join(nval* x, nval* y);
 nval* nval_copy(nval* v);
+int nval_vec_len(nval* v);
+nval** nval_vec_items(nval* v);
+void nval_vec_push(nval* v, nval* x);
+bool nval_reaches(nval* v, void* storage);
+bool nval_map_key_ok(nval* k);
+nval* nval_map_get(nval* m, nval* k);
+void nval_map_put(nval* m, nval* k, nval* v);
+bool nval_map_del(nval* m, nval* k);
+int nval_map_next(nval* m, int i);
 char* ntype_name(int t);
 
 /* Core print statements */
@@ -109,6 +181,9 @@ void nval_print(nval* v);
 void nval_println(nval* v);
 void nval_expr_print(nval* v, char open, char close);
 void nval_print_str(nval* v);
+void nval_print_array(nval* v);
+void nval_print_vec(nval* v);
+void nval_print_map(nval* v);
 
 /* Code evaluation functions */
 nval* nval_eval(nenv* e, nval* v);
@@ -0,0 +1,858 @@
+/*
+ *  Binary images of Nitrogen values.
+ *
+ *  A module image holds the forms read from one source file so loading it
+ *  again skips the reader. Numbers are written as varints, symbols are
+ *  written once and referred to by index afterwards, and text is stored
+ *  with its terminator so it is copied straight out of the mapped image.
+ *
+ *  An environment image holds every binding of the global environment
+ *  once ncore.n has been loaded. Function pointers change from build to
+ *  build, so builtins are written as their place in the builtin table and
+ *  bound to this build's functions when the image is loaded.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ncore.h"
+#include "mempool.h"
+#include "builtins.h"
+#include "nreader.h"
+#include "nimage.h"
+#include "nprofile.h"
+
+bool nimage_cache = true;
+bool nimage_sources = false;
+
+/* Source files loaded into the environment, stamped as they were when loaded */
+typedef struct nimage_stamp {
+    char* path;
+    long len;
+    uint64_t hash;
+} nimage_stamp;
+
+static nimage_stamp* sources = NULL;
+static int source_count = 0;
+
+/* Magic, version, then the length and hash of the source it was made from.
+ * An environment image also has the hash of the builtin names after it,
+ * then the path, length and hash of every file loaded into it */
+#define NIMAGE_MODULE "NITC"
+#define NIMAGE_ENV "NITE"
+#define NIMAGE_VERSION 3
+#define NIMAGE_HEADER_SIZE 21
+
+enum { NIMAGE_NUM = 1, NIMAGE_DOUBLE, NIMAGE_SYM, NIMAGE_SYM_REF,
+       NIMAGE_STR, NIMAGE_SEXPR, NIMAGE_QEXPR,
+       NIMAGE_ERR, NIMAGE_OK, NIMAGE_EMPTY, NIMAGE_QUIT,
+       NIMAGE_BUILTIN, NIMAGE_MACRO, NIMAGE_LAMBDA,
+       NIMAGE_ARRAY, NIMAGE_VEC, NIMAGE_MAP, NIMAGE_SHARED_REF };
+
+uint64_t nimage_hash(const char* src, long len) {
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (long i = 0; i < len; i++) {
+        h ^= (unsigned char)src[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Things already written, found by name for symbols and by address for shared storage */
+typedef struct nimage_table {
+    bool text;
+    void** keys;
+    int* ids;
+    int count;
+    int capacity;
+} nimage_table;
+
+static unsigned long nimage_table_hash(nimage_table* t, void* k) {
+    if (t->text) { return nimage_hash(k, strlen(k)); }
+    return ((uintptr_t)k >> 4) * 2654435761UL;
+}
+
+/* Id given to a key when it was first seen, or -1 after giving a new key the next id */
+static int nimage_table_index(nimage_table* t, void* k) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        int old = t->capacity;
+        void** keys = t->keys;
+        int* ids = t->ids;
+        t->capacity = old ? old * 2 : 64;
+        t->keys = calloc(t->capacity, sizeof(void*));
+        t->ids = malloc(sizeof(int) * t->capacity);
+        for (int i = 0; i < old; i++) {
+            if (keys[i] == NULL) { continue; }
+            unsigned long j = nimage_table_hash(t, keys[i]) & (t->capacity - 1);
+            while (t->keys[j]) { j = (j + 1) & (t->capacity - 1); }
+            t->keys[j] = keys[i];
+            t->ids[j] = ids[i];
+        }
+        free(keys);
+        free(ids);
+    }
+
+    unsigned long i = nimage_table_hash(t, k) & (t->capacity - 1);
+    while (t->keys[i]) {
+        if (t->text ? strcmp(t->keys[i], k) == 0 : t->keys[i] == k) { return t->ids[i]; }
+        i = (i + 1) & (t->capacity - 1);
+    }
+    t->keys[i] = k;
+    t->ids[i] = t->count++;
+    return -1;
+}
+
+/* Image being written */
+typedef struct nimage_out {
+    unsigned char* data;
+    long len;
+    long size;
+    nimage_table syms;
+    /* Vectors and maps, so storage shared by several values stays shared */
+    nimage_table shared;
+    /* Builtins are written as their place in this table */
+    nenv* builtins;
+} nimage_out;
+
+static void nimage_put(nimage_out* o, const void* p, long n) {
+    if (o->len + n > o->size) {
+        while (o->len + n > o->size) { o->size = o->size ? o->size * 2 : 4096; }
+        o->data = realloc(o->data, o->size);
+    }
+    memcpy(o->data + o->len, p, n);
+    o->len += n;
+}
+
+static void nimage_put_byte(nimage_out* o, unsigned char b) {
+    nimage_put(o, &b, 1);
+}
+
+static void nimage_put_uint(nimage_out* o, uint64_t x) {
+    unsigned char b[10];
+    int n = 0;
+    do {
+        b[n] = x & 0x7f;
+        x >>= 7;
+        if (x) { b[n] |= 0x80; }
+        n++;
+    } while (x);
+    nimage_put(o, b, n);
+}
+
+/* Zigzag so small negative numbers stay short */
+static void nimage_put_int(nimage_out* o, long x) {
+    uint64_t z = (uint64_t)x << 1;
+    nimage_put_uint(o, x < 0 ? ~z : z);
+}
+
+static void nimage_put_u64(nimage_out* o, uint64_t x) {
+    unsigned char b[8];
+    for (int i = 0; i < 8; i++) { b[i] = (x >> (i * 8)) & 0xff; }
+    nimage_put(o, b, 8);
+}
+
+static void nimage_put_double(nimage_out* o, double d) {
+    uint64_t x;
+    memcpy(&x, &d, sizeof(x));
+    nimage_put_u64(o, x);
+}
+
+static void nimage_put_text(nimage_out* o, char* s) {
+    long n = strlen(s);
+    nimage_put_uint(o, n);
+    nimage_put(o, s, n + 1);
+}
+
+static bool nimage_write_env(nimage_out* o, nenv* e);
+
+/* False for values that have no image, the caller drops the whole image */
+static bool nimage_write(nimage_out* o, nval* v) {
+    switch (v->type) {
+        case NVAL_NUM:
+            nimage_put_byte(o, NIMAGE_NUM);
+            nimage_put_int(o, v->num);
+            return true;
+        case NVAL_DOUBLE:
+            nimage_put_byte(o, NIMAGE_DOUBLE);
+            nimage_put_double(o, v->doub);
+            return true;
+        case NVAL_SYM: {
+            int i = nimage_table_index(&o->syms, v->sym);
+            if (i >= 0) {
+                nimage_put_byte(o, NIMAGE_SYM_REF);
+                nimage_put_uint(o, i);
+            } else {
+                nimage_put_byte(o, NIMAGE_SYM);
+                nimage_put_text(o, v->sym);
+            }
+            return true;
+        }
+        case NVAL_STR:
+            nimage_put_byte(o, NIMAGE_STR);
+            nimage_put_text(o, v->str);
+            return true;
+        case NVAL_SEXPR:
+        case NVAL_QEXPR:
+            nimage_put_byte(o, v->type == NVAL_SEXPR ? NIMAGE_SEXPR : NIMAGE_QEXPR);
+            nimage_put_uint(o, v->count);
+            for (int i = 0; i < v->count; i++) {
+                if (!nimage_write(o, v->cell[i])) { return false; }
+            }
+            return true;
+
+        case NVAL_ERR:
+            nimage_put_byte(o, NIMAGE_ERR);
+            nimage_put_text(o, v->err);
+            return true;
+        case NVAL_OK:
+            nimage_put_byte(o, NIMAGE_OK);
+            nimage_put_byte(o, v->ok);
+            return true;
+        case NVAL_EMPTY:
+            nimage_put_byte(o, NIMAGE_EMPTY);
+            return true;
+        case NVAL_QUIT:
+            nimage_put_byte(o, NIMAGE_QUIT);
+            nimage_put_int(o, v->num);
+            return true;
+
+        case NVAL_FUN:
+        case NVAL_FUN_MACRO:
+            if (v->builtin) {
+                if (o->builtins == NULL) { return false; }
+                for (int i = 0; i < o->builtins->count; i++) {
+                    if (o->builtins->vals[i]->builtin == v->builtin) {
+                        nimage_put_byte(o, v->type == NVAL_FUN ? NIMAGE_BUILTIN : NIMAGE_MACRO);
+                        nimage_put_uint(o, i);
+                        return true;
+                    }
+                }
+                return false;
+            }
+            nimage_put_byte(o, NIMAGE_LAMBDA);
+            nimage_put_text(o, v->name ? v->name : "");
+            return nimage_write(o, v->formals) && nimage_write(o, v->body)
+                && nimage_write_env(o, v->env);
+
+        case NVAL_ARRAY:
+            nimage_put_byte(o, NIMAGE_ARRAY);
+            nimage_put_byte(o, v->arr_type == NVAL_DOUBLE);
+            nimage_put_uint(o, v->count);
+            for (int i = 0; i < v->count; i++) {
+                if (v->arr_type == NVAL_DOUBLE) { nimage_put_double(o, v->doubs[i]); }
+                else { nimage_put_int(o, v->nums[i]); }
+            }
+            return true;
+
+        case NVAL_VEC: {
+            int i = nimage_table_index(&o->shared, v->vec);
+            nimage_put_byte(o, i >= 0 ? NIMAGE_SHARED_REF : NIMAGE_VEC);
+            nimage_put_uint(o, v->vec_start);
+            nimage_put_int(o, v->vec_end);
+            if (i >= 0) {
+                nimage_put_uint(o, i);
+                return true;
+            }
+            nimage_put_uint(o, v->vec->count);
+            for (int j = 0; j < v->vec->count; j++) {
+                if (!nimage_write(o, v->vec->items[j])) { return false; }
+            }
+            return true;
+        }
+
+        case NVAL_MAP: {
+            int i = nimage_table_index(&o->shared, v->map);
+            if (i >= 0) {
+                nimage_put_byte(o, NIMAGE_SHARED_REF);
+                nimage_put_uint(o, 0);
+                nimage_put_int(o, -1);
+                nimage_put_uint(o, i);
+                return true;
+            }
+            nimage_put_byte(o, NIMAGE_MAP);
+            nimage_put_uint(o, v->map->count);
+            for (int j = nval_map_next(v, 0); j != -1; j = nval_map_next(v, j+1)) {
+                if (!nimage_write(o, v->map->keys[j])) { return false; }
+                if (!nimage_write(o, v->map->vals[j])) { return false; }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nimage_write_env(nimage_out* o, nenv* e) {
+    nimage_put_uint(o, e->count);
+    for (int i = 0; i < e->count; i++) {
+        nimage_put_text(o, e->syms[i]);
+        nimage_put_byte(o, e->protected[i]);
+        if (!nimage_write(o, e->vals[i])) { return false; }
+    }
+    return true;
+}
+
+static void nimage_out_free(nimage_out* o) {
+    free(o->data);
+    free(o->syms.keys);
+    free(o->syms.ids);
+    free(o->shared.keys);
+    free(o->shared.ids);
+}
+
+/* Image being read, every length is checked against what is left of it */
+typedef struct nimage_in {
+    const unsigned char* data;
+    long len;
+    long pos;
+    bool bad;
+    /* Symbols in the order they were first written */
+    void** syms;
+    int sym_count;
+    int sym_size;
+    /* First value seen for each vector or map storage */
+    void** shared;
+    int shared_count;
+    int shared_size;
+    nenv* builtins;
+} nimage_in;
+
+static void nimage_push(void*** items, int* count, int* size, void* x) {
+    if (*count == *size) {
+        *size = *size ? *size * 2 : 64;
+        *items = realloc(*items, sizeof(void*) * *size);
+    }
+    (*items)[(*count)++] = x;
+}
+
+static uint64_t nimage_get_uint(nimage_in* in) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && in->pos < in->len; shift += 7) {
+        unsigned char b = in->data[in->pos++];
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { return x; }
+    }
+    in->bad = true;
+    return 0;
+}
+
+static long nimage_get_int(nimage_in* in) {
+    uint64_t x = nimage_get_uint(in);
+    return (long)(x & 1 ? ~(x >> 1) : x >> 1);
+}
+
+static unsigned char nimage_get_byte(nimage_in* in) {
+    if (in->pos >= in->len) {
+        in->bad = true;
+        return 0;
+    }
+    return in->data[in->pos++];
+}
+
+static uint64_t nimage_get_u64(nimage_in* in) {
+    uint64_t x = 0;
+    if (in->len - in->pos < 8) {
+        in->bad = true;
+        return 0;
+    }
+    for (int i = 0; i < 8; i++) { x |= (uint64_t)in->data[in->pos++] << (i * 8); }
+    return x;
+}
+
+static double nimage_get_double(nimage_in* in) {
+    uint64_t x = nimage_get_u64(in);
+    double d;
+    memcpy(&d, &x, sizeof(d));
+    return d;
+}
+
+static char* nimage_get_text(nimage_in* in) {
+    uint64_t n = nimage_get_uint(in);
+    if (in->bad || n >= (uint64_t)(in->len - in->pos) || in->data[in->pos + n] != '\0') {
+        in->bad = true;
+        return NULL;
+    }
+    char* s = (char*)in->data + in->pos;
+    in->pos += n + 1;
+    return s;
+}
+
+/* Count of items that each take at least min bytes, if that many are left */
+static bool nimage_get_count(nimage_in* in, int min, int* count) {
+    uint64_t n = nimage_get_uint(in);
+    if (in->bad || n > (uint64_t)(in->len - in->pos) / min) {
+        in->bad = true;
+        return false;
+    }
+    *count = n;
+    return true;
+}
+
+/* A slice has to lie inside its vector */
+static bool nimage_vec_view(nimage_in* in, nval* v, long start, long end) {
+    if (start > v->vec->count || end < -1 || end > v->vec->count || (end != -1 && end < start)) {
+        in->bad = true;
+        return false;
+    }
+    v->vec_start = start;
+    v->vec_end = end;
+    return true;
+}
+
+static nenv* nimage_read_env(nimage_in* in);
+
+static nval* nimage_read(nimage_in* in) {
+    if (in->pos >= in->len) {
+        in->bad = true;
+        return NULL;
+    }
+
+    unsigned char tag = in->data[in->pos++];
+    switch (tag) {
+        case NIMAGE_NUM: {
+            long x = nimage_get_int(in);
+            if (in->bad) { return NULL; }
+            return nval_num(x);
+        }
+        case NIMAGE_DOUBLE: {
+            double d = nimage_get_double(in);
+            if (in->bad) { return NULL; }
+            return nval_double(d);
+        }
+        case NIMAGE_SYM: {
+            char* s = nimage_get_text(in);
+            if (s == NULL) { return NULL; }
+            nimage_push(&in->syms, &in->sym_count, &in->sym_size, s);
+            return nval_sym(s);
+        }
+        case NIMAGE_SYM_REF: {
+            uint64_t i = nimage_get_uint(in);
+            if (in->bad || i >= (uint64_t)in->sym_count) { break; }
+            return nval_sym(in->syms[i]);
+        }
+        case NIMAGE_STR: {
+            char* s = nimage_get_text(in);
+            if (s == NULL) { return NULL; }
+            return nval_str(s);
+        }
+        case NIMAGE_SEXPR:
+        case NIMAGE_QEXPR: {
+            int n;
+            if (!nimage_get_count(in, 2, &n)) { return NULL; }
+            nval* v = tag == NIMAGE_SEXPR ? nval_sexpr() : nval_qexpr();
+            if (n == 0) { return v; }
+            v->cell = malloc(sizeof(nval*) * n);
+            POOL_PROFILE_MALLOC(sizeof(nval*) * n);
+            for (; v->count < n; v->count++) {
+                nval* x = nimage_read(in);
+                if (x == NULL) {
+                    nval_del(v);
+                    return NULL;
+                }
+                v->cell[v->count] = x;
+            }
+            return v;
+        }
+
+        case NIMAGE_ERR: {
+            char* s = nimage_get_text(in);
+            if (s == NULL) { return NULL; }
+            return nval_err("%s", s);
+        }
+        case NIMAGE_OK: {
+            unsigned char ok = nimage_get_byte(in);
+            if (in->bad) { return NULL; }
+            nval* v = nval_ok();
+            v->ok = ok;
+            return v;
+        }
+        case NIMAGE_EMPTY:
+            return nval_empty();
+        case NIMAGE_QUIT: {
+            long x = nimage_get_int(in);
+            if (in->bad) { return NULL; }
+            return nval_quit(x);
+        }
+
+        case NIMAGE_BUILTIN:
+        case NIMAGE_MACRO: {
+            uint64_t i = nimage_get_uint(in);
+            if (in->bad || in->builtins == NULL || i >= (uint64_t)in->builtins->count) { break; }
+            nbuiltin f = in->builtins->vals[i]->builtin;
+            nval* v = tag == NIMAGE_BUILTIN ? nval_fun(f) : nval_macro(f);
+            v->name = in->builtins->vals[i]->name;
+            v->id = in->builtins->vals[i]->id;
+            return v;
+        }
+        case NIMAGE_LAMBDA: {
+            char* name = nimage_get_text(in);
+            if (name == NULL) { return NULL; }
+            nval* formals = nimage_read(in);
+            if (formals == NULL) { return NULL; }
+            nval* body = nimage_read(in);
+            if (body == NULL) {
+                nval_del(formals);
+                return NULL;
+            }
+            nenv* env = nimage_read_env(in);
+            if (env == NULL) {
+                nval_del(formals);
+                nval_del(body);
+                return NULL;
+            }
+            nval* v = nval_lambda(formals, body);
+            nenv_del(v->env);
+            v->env = env;
+            if (name[0]) { v->name = nprofile_intern(name); }
+            return v;
+        }
+
+        case NIMAGE_ARRAY: {
+            bool doubles = nimage_get_byte(in);
+            int n;
+            if (!nimage_get_count(in, 1, &n)) { return NULL; }
+            nval* v = nval_array(doubles ? NVAL_DOUBLE : NVAL_NUM, n);
+            for (int i = 0; i < n; i++) {
+                if (doubles) { v->doubs[i] = nimage_get_double(in); }
+                else { v->nums[i] = nimage_get_int(in); }
+            }
+            if (in->bad) {
+                nval_del(v);
+                return NULL;
+            }
+            return v;
+        }
+
+        case NIMAGE_VEC: {
+            long start = nimage_get_uint(in);
+            long end = nimage_get_int(in);
+            int n;
+            if (!nimage_get_count(in, 2, &n)) { return NULL; }
+            nval* v = nval_vec();
+            nimage_push(&in->shared, &in->shared_count, &in->shared_size, v);
+            for (int i = 0; i < n; i++) {
+                nval* x = nimage_read(in);
+                if (x == NULL) {
+                    nval_del(v);
+                    return NULL;
+                }
+                nval_vec_push(v, x);
+            }
+            if (!nimage_vec_view(in, v, start, end)) {
+                nval_del(v);
+                return NULL;
+            }
+            return v;
+        }
+
+        case NIMAGE_MAP: {
+            int n;
+            if (!nimage_get_count(in, 4, &n)) { return NULL; }
+            nval* v = nval_map();
+            nimage_push(&in->shared, &in->shared_count, &in->shared_size, v);
+            for (int i = 0; i < n; i++) {
+                nval* k = nimage_read(in);
+                nval* x = k ? nimage_read(in) : NULL;
+                if (x == NULL || !nval_map_key_ok(k)) {
+                    if (k) { nval_del(k); }
+                    if (x) { nval_del(x); }
+                    nval_del(v);
+                    in->bad = true;
+                    return NULL;
+                }
+                nval_map_put(v, k, x);
+            }
+            return v;
+        }
+
+        case NIMAGE_SHARED_REF: {
+            long start = nimage_get_uint(in);
+            long end = nimage_get_int(in);
+            uint64_t i = nimage_get_uint(in);
+            if (in->bad || i >= (uint64_t)in->shared_count) { break; }
+            nval* v = nval_copy(in->shared[i]);
+            if (v->type == NVAL_VEC && !nimage_vec_view(in, v, start, end)) {
+                nval_del(v);
+                return NULL;
+            }
+            return v;
+        }
+    }
+
+    in->bad = true;
+    return NULL;
+}
+
+static nenv* nimage_read_env(nimage_in* in) {
+    int n;
+    if (!nimage_get_count(in, 4, &n)) { return NULL; }
+    nenv* e = nenv_new();
+    if (n == 0) { return e; }
+
+    e->syms = malloc(sizeof(char*) * n);
+    e->vals = malloc(sizeof(nval*) * n);
+    e->protected = malloc(sizeof(bool) * n);
+    POOL_PROFILE_MALLOC(sizeof(char*) * n);
+    POOL_PROFILE_MALLOC(sizeof(nval*) * n);
+    POOL_PROFILE_MALLOC(sizeof(bool) * n);
+    for (; e->count < n; e->count++) {
+        char* s = nimage_get_text(in);
+        bool p = nimage_get_byte(in);
+        nval* v = in->bad ? NULL : nimage_read(in);
+        if (v == NULL) {
+            nenv_del(e);
+            return NULL;
+        }
+        e->syms[e->count] = malloc(strlen(s) + 1);
+        POOL_PROFILE_MALLOC(strlen(s) + 1);
+        strcpy(e->syms[e->count], s);
+        e->protected[e->count] = p;
+        e->vals[e->count] = v;
+    }
+    return e;
+}
+
+static void nimage_in_free(nimage_in* in) {
+    free(in->syms);
+    free(in->shared);
+}
+
+/* Both kinds of image start with what they were made from */
+static void nimage_put_header(nimage_out* o, const char* magic, long len, uint64_t hash) {
+    nimage_put(o, magic, 4);
+    nimage_put_byte(o, NIMAGE_VERSION);
+    nimage_put_u64(o, len);
+    nimage_put_u64(o, hash);
+}
+
+static bool nimage_get_header(nimage_in* in, const char* magic, long len, uint64_t hash) {
+    if (in->len < NIMAGE_HEADER_SIZE || memcmp(in->data, magic, 4) != 0
+            || in->data[4] != NIMAGE_VERSION) {
+        return false;
+    }
+    in->pos = 5;
+    return nimage_get_u64(in) == (uint64_t)len && nimage_get_u64(in) == hash;
+}
+
+/* Written aside and renamed into place so readers never see half an image */
+static bool nimage_put_file(nimage_out* o, const char* path) {
+    char* tmp = malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+
+    bool ok = false;
+    FILE* fp = fopen(tmp, "wb");
+    if (fp) {
+        ok = fwrite(o->data, 1, o->len, fp) == (size_t)o->len;
+        ok = fclose(fp) == 0 && ok;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) { remove(tmp); }
+    }
+
+    free(tmp);
+    return ok;
+}
+
+/* Name of the image kept next to a source file */
+static char* nimage_module_path(const char* filename) {
+    char* path = malloc(strlen(filename) + 2);
+    strcpy(path, filename);
+    strcat(path, "c");
+    return path;
+}
+
+/* Length and hash of the source a module image was made from */
+bool nimage_module_stamp(const unsigned char* data, long size, long* len, uint64_t* hash) {
+    nimage_in in = { data, size };
+    if (size < NIMAGE_HEADER_SIZE || memcmp(data, NIMAGE_MODULE, 4) != 0 || data[4] != NIMAGE_VERSION) {
+        return false;
+    }
+    in.pos = 5;
+    *len = nimage_get_u64(&in);
+    *hash = nimage_get_u64(&in);
+    return true;
+}
+
+nval* nimage_read_module(const unsigned char* data, long size) {
+    long len;
+    uint64_t hash;
+    if (!nimage_module_stamp(data, size, &len, &hash)) { return NULL; }
+
+    nimage_in in = { data, size, NIMAGE_HEADER_SIZE };
+    nval* forms = nimage_read(&in);
+    /* A truncated or padded image is not trusted */
+    if (forms && (in.pos != in.len || forms->type != NVAL_SEXPR)) {
+        nval_del(forms);
+        forms = NULL;
+    }
+    nimage_in_free(&in);
+    return forms;
+}
+
+unsigned char* nimage_module(nval* forms, long len, uint64_t hash, long* size) {
+    nimage_out o = { NULL, 0, 0, { true } };
+    nimage_put_header(&o, NIMAGE_MODULE, len, hash);
+
+    unsigned char* data = NULL;
+    if (nimage_write(&o, forms)) {
+        data = o.data;
+        *size = o.len;
+        o.data = NULL;
+    }
+
+    nimage_out_free(&o);
+    return data;
+}
+
+nval* nimage_load_module(const char* filename, long len, uint64_t hash) {
+    char* path = nimage_module_path(filename);
+    nfile f;
+    bool found = nfile_map(&f, path);
+    free(path);
+    if (!found) { return NULL; }
+
+    long src_len;
+    uint64_t src_hash;
+    const unsigned char* data = (const unsigned char*)f.src;
+    nval* forms = NULL;
+    if (nimage_module_stamp(data, f.len, &src_len, &src_hash) && src_len == len && src_hash == hash) {
+        forms = nimage_read_module(data, f.len);
+    }
+
+    nfile_close(&f);
+    return forms;
+}
+
+/* Failing to write the image only costs the next load a parse, so errors are ignored */
+void nimage_save_module(const char* filename, long len, uint64_t hash, nval* forms) {
+    long size;
+    unsigned char* data = nimage_module(forms, len, hash, &size);
+    if (data == NULL) { return; }
+
+    nimage_out o = { data, size, size };
+    char* path = nimage_module_path(filename);
+    nimage_put_file(&o, path);
+    free(path);
+    free(data);
+}
+
+/* Builtins of this build and a hash of their names, which an environment image has to match */
+static nenv* nimage_builtins(uint64_t* hash) {
+    nenv* e = nenv_new();
+    nenv_add_builtins(e);
+    *hash = nimage_hash(NULL, 0);
+    for (int i = 0; i < e->count; i++) {
+        uint64_t h = nimage_hash(e->syms[i], strlen(e->syms[i]) + 1);
+        *hash = (*hash ^ h) * 1099511628211ULL;
+    }
+    return e;
+}
+
+static void nimage_source_add(const char* path, long len, uint64_t hash) {
+    for (int i = 0; i < source_count; i++) {
+        if (strcmp(sources[i].path, path) == 0) {
+            sources[i].len = len;
+            sources[i].hash = hash;
+            return;
+        }
+    }
+    sources = realloc(sources, sizeof(nimage_stamp) * (source_count + 1));
+    sources[source_count].path = malloc(strlen(path) + 1);
+    strcpy(sources[source_count].path, path);
+    sources[source_count].len = len;
+    sources[source_count].hash = hash;
+    source_count++;
+}
+
+void nimage_source(const char* path) {
+    nfile f;
+    if (!nfile_open(&f, path)) { return; }
+    nimage_source_add(path, f.len, nimage_hash(f.src, f.len));
+    nfile_close(&f);
+}
+
+void nimage_cleanup(void) {
+    for (int i = 0; i < source_count; i++) { free(sources[i].path); }
+    free(sources);
+    sources = NULL;
+    source_count = 0;
+}
+
+/* True when every file recorded in an image still has the text it was loaded with */
+static bool nimage_get_sources(nimage_in* in) {
+    int n;
+    if (!nimage_get_count(in, 17, &n)) { return false; }
+    for (int i = 0; i < n; i++) {
+        char* path = nimage_get_text(in);
+        long len = nimage_get_u64(in);
+        uint64_t hash = nimage_get_u64(in);
+        if (in->bad) { return false; }
+
+        nfile f;
+        if (!nfile_open(&f, path)) { return false; }
+        bool same = f.len == len && nimage_hash(f.src, f.len) == hash;
+        nfile_close(&f);
+        if (!same) { return false; }
+    }
+    return true;
+}
+
+/* Loading the image counts as loading its files, so a later dump records them too */
+static void nimage_keep_sources(const unsigned char* data, long size, long pos) {
+    nimage_in in = { data, size, pos };
+    int n;
+    if (!nimage_get_count(&in, 17, &n)) { return; }
+    for (int i = 0; i < n; i++) {
+        char* path = nimage_get_text(&in);
+        long len = nimage_get_u64(&in);
+        uint64_t hash = nimage_get_u64(&in);
+        if (in.bad) { return; }
+        nimage_source_add(path, len, hash);
+    }
+}
+
+nenv* nimage_load_env(const char* path, long len, uint64_t hash) {
+    nfile f;
+    if (!nfile_map(&f, path)) { return NULL; }
+
+    uint64_t builtins_hash;
+    nimage_in in = { (const unsigned char*)f.src, f.len };
+    in.builtins = nimage_builtins(&builtins_hash);
+
+    nenv* e = NULL;
+    if (nimage_get_header(&in, NIMAGE_ENV, len, hash) && nimage_get_u64(&in) == builtins_hash) {
+        long sources_pos = in.pos;
+        if (nimage_get_sources(&in)) { e = nimage_read_env(&in); }
+        if (e && in.pos != in.len) {
+            nenv_del(e);
+            e = NULL;
+        }
+        if (e && nimage_sources) { nimage_keep_sources(in.data, in.len, sources_pos); }
+    }
+
+    nenv_del(in.builtins);
+    nimage_in_free(&in);
+    nfile_close(&f);
+    return e;
+}
+
+bool nimage_save_env(const char* path, nenv* e, long len, uint64_t hash) {
+    uint64_t builtins_hash;
+    nimage_out o = { NULL, 0, 0, { true } };
+    o.builtins = nimage_builtins(&builtins_hash);
+    nimage_put_header(&o, NIMAGE_ENV, len, hash);
+    nimage_put_u64(&o, builtins_hash);
+    nimage_put_uint(&o, source_count);
+    for (int i = 0; i < source_count; i++) {
+        nimage_put_text(&o, sources[i].path);
+        nimage_put_u64(&o, sources[i].len);
+        nimage_put_u64(&o, sources[i].hash);
+    }
+
+    bool ok = nimage_write_env(&o, e) && nimage_put_file(&o, path);
+
+    nenv_del(o.builtins);
+    nimage_out_free(&o);
+    return ok;
+}
@@ -0,0 +1,41 @@
+#ifndef nimage_h
+#define nimage_h
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ncore.h"
+
+/* Use and write compiled .nc images next to loaded source files */
+extern bool nimage_cache;
+
+/* Content hash of source text, stored in images to tell when they are stale */
+uint64_t nimage_hash(const char* src, long len);
+
+/* Forms read from a source file, kept in binary as <filename>c.
+ * Load returns NULL when there is no image or it was made from other text */
+nval* nimage_load_module(const char* filename, long len, uint64_t hash);
+void nimage_save_module(const char* filename, long len, uint64_t hash, nval* forms);
+
+/* Module images in memory. nimage_module returns a malloc'd image, or NULL
+ * if the forms hold values that have no image */
+unsigned char* nimage_module(nval* forms, long len, uint64_t hash, long* size);
+bool nimage_module_stamp(const unsigned char* data, long size, long* len, uint64_t* hash);
+nval* nimage_read_module(const unsigned char* data, long size);
+
+/* ncore.n, built into the interpreter as a module image by tools/nembed */
+extern const unsigned char ncore_image[];
+extern const long ncore_image_size;
+
+/* Record the length and hash of files loaded while this is set, for nimage_save_env.
+ * A file that cannot be read is not recorded, loading it fails anyway */
+extern bool nimage_sources;
+void nimage_source(const char* path);
+void nimage_cleanup(void);
+
+/* Global environment after bootstrap, stamped with the length and hash of ncore.n
+ * and of every recorded file. Load returns NULL when the image is missing, made by
+ * other builtins, or ncore.n or any of those files has changed */
+nenv* nimage_load_env(const char* path, long len, uint64_t hash);
+bool nimage_save_env(const char* path, nenv* e, long len, uint64_t hash);
+
+#endif
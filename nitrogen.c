@@ -1,19 +1,23 @@
+#define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <unistd.h>
-#include <libgen.h>
+#include <string.h>
+#include <time.h>
 
 #include "mpc.h"
 
 #include "ncore.h"
 #include "builtins.h"
 #include "mempool.h"
+#include "nreader.h"
+#include "nimage.h"
+#include "nprofile.h"
+#include "ntrace.h"
+#include "nperf.h"
 
 /* Windows doesn't use the editline library */
 #ifdef _WIN32
-#include <string.h>
-
 static char buffer[2048];
 
 char* readline(char* prompt) {
@@ -32,140 +36,157 @@ void add_history(char* unused) {}
 #include <editline/history.h>
 #endif
 
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Nitrogen;
-
-nval* nval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    if (strstr(t->contents, ".")) {
-        double x = strtod(t->contents, NULL);
-        return errno != ERANGE ? nval_double(x) : nval_err("invalid number");
-    } else {
-        long x = strtol(t->contents, NULL, 10);
-        return errno != ERANGE ? nval_num(x) : nval_err("invalid number");
-    }
-}
-
-nval* nval_read_str(mpc_ast_t* t) {
-    t->contents[strlen(t->contents)-1] = '\0';
-    char* unescaped = malloc(strlen(t->contents+1)+1);
-    strcpy(unescaped, t->contents+1);
-    unescaped = mpcf_unescape(unescaped);
-    nval* str = nval_str(unescaped);
-    free(unescaped);
-    return str;
+/* Milliseconds on a clock that only goes forward */
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
 }
 
-nval* nval_read(mpc_ast_t* t) {
-
-    /* If Symbol or Number return conversion to that type */
-    if (strstr(t->tag, "number")) { return nval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return nval_sym(t->contents); }
-    if (strstr(t->tag, "string")) { return nval_read_str(t); }
-
-    /* If root (>) or s/qexpr then create empty list */
-    nval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = nval_sexpr(); }
-    if (strstr(t->tag, "sexpr"))  { x = nval_sexpr(); }
-    if (strstr(t->tag, "qexpr"))  { x = nval_qexpr(); }
-
-    /* Fill this list with any valid expression contained within */
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        if (strstr(t->children[i]->tag, "comment")) { continue; }
-        x = nval_add(x, nval_read(t->children[i]));
+int main(int argc, char** argv) {
+    nreader_mpc_init();
+
+    /* Options come before any files to load */
+    char* image = NULL;
+    char* dump_image = NULL;
+    char* profile = NULL;
+    char* alloc_profile = NULL;
+    char* trace = NULL;
+    bool stats = false;
+    int first_file = 1;
+    for (; first_file < argc && strncmp(argv[first_file], "--", 2) == 0; first_file++) {
+        if (strcmp(argv[first_file], "--mpc-reader") == 0) {
+            nreader_use_mpc = true;
+        } else if (strcmp(argv[first_file], "--stream") == 0) {
+            nreader_stream = true;
+        } else if (strcmp(argv[first_file], "--no-cache") == 0) {
+            nimage_cache = false;
+        } else if (strcmp(argv[first_file], "--stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[first_file], "--perf") == 0) {
+            nperf_loads = true;
+        } else if (strcmp(argv[first_file], "--image") == 0 && first_file + 1 < argc) {
+            image = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--dump-image") == 0 && first_file + 1 < argc) {
+            dump_image = argv[++first_file];
+            nimage_sources = true;
+        } else if (strcmp(argv[first_file], "--profile") == 0 && first_file + 1 < argc) {
+            profile = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--trace") == 0 && first_file + 1 < argc) {
+            trace = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--alloc-profile") == 0 && first_file + 1 < argc) {
+            alloc_profile = argv[++first_file];
+        } else {
+            printf("Unknown option %s\n", argv[first_file]);
+            nreader_mpc_cleanup();
+            return 1;
+        }
     }
 
-    return x;
-}
-
-int main(int argc, char** argv) {
-    /* Setup MPC parsers */
-    Number    = mpc_new("number");
-    Symbol    = mpc_new("symbol");
-    String    = mpc_new("string");
-    Comment   = mpc_new("comment");
-    Sexpr     = mpc_new("sexpr");
-    Qexpr     = mpc_new("qexpr");
-    Expr      = mpc_new("expr");
-    Nitrogen  = mpc_new("nitrogen");
-
-    /* Define parsers */
-    mpca_lang(MPCA_LANG_DEFAULT,
-        "                                                                       \
-          number    : /-?[.|0-9]+/ ;                                            \
-          symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;                       \
-          string    : /\"(\\\\.|[^\"])*\"/ ;                                    \
-          comment   : /[;#][^\\r\\n]*/ ;                                        \
-          sexpr     : '(' <expr>* ')' ;                                         \
-          qexpr     : '{' <expr>* '}' ;                                         \
-          expr      : <number> | <symbol> | <sexpr>                             \
-                    | <qexpr>  | <string> | <comment> ;                         \
-          nitrogen  : /^/ <expr>* /$/ ;                                         \
-        ",
-        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Nitrogen);
-
-    nenv* e = nenv_new();
-    nenv_add_builtins(e);
-
-    char dest[4096];
-    if (readlink("/proc/self/exe", dest, 4096) == -1) {
-        puts("Error loading Nitrogen interpreter");
-        nenv_del(e);
-        mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Nitrogen);
-        deallocate_pools();
-        return 1;
+    /* ncore.n is built in, images are stamped with the source it was made from */
+    long core_len = 0;
+    uint64_t core_hash = 0;
+    nimage_module_stamp(ncore_image, ncore_image_size, &core_len, &core_hash);
+
+    /* Start from the image if it is up to date, otherwise evaluate ncore.n */
+    nenv* e = NULL;
+    if (image) { e = nimage_load_env(image, core_len, core_hash); }
+    if (e == NULL) {
+        e = nenv_new();
+        nenv_add_builtins(e);
+
+        nval* core = nimage_read_module(ncore_image, ncore_image_size);
+        if (core) {
+            nval_del(builtin_load_forms(e, core));
+        } else {
+            puts("Error loading Nitrogen interpreter");
+        }
     }
 
-    strcat(dirname(dest), "/ncore.n");
-    nval* args = nval_add(nval_sexpr(), nval_str(dest));
-    nval* x = builtin_load(e, args);
-    if (x->type == NVAL_ERR) { nval_println(x); }
-    nval_del(x);
+    /* Statistics and the profile cover what is run after startup */
+    if (profile && !nprofile_start(1000)) {
+        printf("Could not start the profiler\n");
+        profile = NULL;
+    }
+    if (alloc_profile) { pool_profile_start(); }
+    if (trace && !ntrace_start(1 << 20)) {
+        printf("Could not start tracing\n");
+        trace = NULL;
+    }
+    double start = now_ms();
+    memory_pool_counts before = pool_counts();
 
-    if (argc == 1) {
+    if (first_file == argc && dump_image == NULL) {
         puts("Nitrogen Version 0.2.0");
         puts("Press Ctrl+c or (exit) to Exit\n");
 
+        /* Lines are fed to one reader, so an expression can go on over several
+         * lines. Everything completed by a line is evaluated once nothing is left open */
+        nreader reader;
+        nreader_open_stream(&reader, "<stdin>");
+        nval* forms = nval_sexpr();
+
         while (1) {
-            char* input = readline("nitrogen> ");
+            char* input = readline(nreader_pending(&reader) ? "      ... " : "nitrogen> ");
+            if (input == NULL) { break; }
             add_history(input);
 
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Nitrogen, &r)) {
+            nval* expr;
+            if (nreader_use_mpc) {
+                mpc_result_t r;
+                if (!mpc_parse("<stdin>", input, Nitrogen, &r)) {
+                    mpc_err_print(r.error);
+                    mpc_err_delete(r.error);
+                    free(input);
+                    continue;
+                }
                 //mpc_ast_print(r.output);
-                nval* x = nval_eval(e, nval_read(r.output));
-                /* Test for special NVAL_QUIT type */
-                if (x->type == NVAL_QUIT) {
-                    printf("%s\n", "Quitting Nitrogen Interpreter");
+                expr = nval_read(r.output);
+                mpc_ast_delete(r.output);
+            } else {
+                nreader_feed(&reader, input, strlen(input));
+                nreader_feed(&reader, "\n", 1);
+
+                nval* x;
+                while ((x = nreader_next(&reader)) && !reader.failed) { nval_add(forms, x); }
+                if (x) {
+                    /* Syntax error, drop the whole expression */
+                    nval_println(x);
                     nval_del(x);
-                    mpc_ast_delete(r.output);
+                    nreader_reset(&reader);
+                    nval_del(forms);
+                    forms = nval_sexpr();
                     free(input);
-                    break;
-                } else {
-                    nval_println(x);
+                    continue;
                 }
+                if (nreader_pending(&reader)) {
+                    free(input);
+                    continue;
+                }
+
+                expr = forms;
+                forms = nval_sexpr();
+            }
+
+            nval* x = nval_eval(e, expr);
+            /* Test for special NVAL_QUIT type */
+            if (x->type == NVAL_QUIT) {
+                printf("%s\n", "Quitting Nitrogen Interpreter");
                 nval_del(x);
-                mpc_ast_delete(r.output);
+                free(input);
+                break;
             } else {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                nval_println(x);
             }
+            nval_del(x);
 
             free(input);
         }
-    } else if (argc >= 2) {
-        for (int i = 1; i < argc; i++) {
+
+        nval_del(forms);
+        nreader_close(&reader);
+    } else {
+        for (int i = first_file; i < argc; i++) {
             nval* args = nval_add(nval_sexpr(), nval_str(argv[i]));
             nval* x = builtin_load(e, args);
             if (x->type == NVAL_ERR) { nval_println(x); }
@@ -173,8 +194,48 @@ int main(int argc, char** argv) {
         }
     }
 
+    /* One line of key=value pairs on stderr, for scripts such as bench/run.sh */
+    if (stats) {
+        double ms = now_ms() - start;
+        memory_pool_counts after = pool_counts();
+        fprintf(stderr, "time_ms=%.3f allocations=%ld frees=%ld peak_chunks=%d pools=%d\n",
+            ms, after.allocations - before.allocations, after.frees - before.frees,
+            after.peak, after.pools);
+    }
+
+    /* profile-stop may already have been called */
+    if (profile && nprofile_running() && !builtin_write_file(profile, nprofile_stop)) {
+        printf("Could not write profile %s\n", profile);
+    }
+
+    /* trace-stop may already have been called */
+    if (trace && ntrace_on) {
+        ntrace_stop();
+        if (!builtin_write_file(trace, ntrace_write)) {
+            printf("Could not write trace %s\n", trace);
+        }
+    }
+
+    if (alloc_profile) {
+        pool_profile_stop();
+        if (!builtin_write_file(alloc_profile, builtin_alloc_profile_write)) {
+            printf("Could not write allocation report %s\n", alloc_profile);
+        }
+    }
+
+    /* Written after any files are loaded, so they can be part of the image */
+    if (dump_image) {
+        if (!nimage_save_env(dump_image, e, core_len, core_hash)) {
+            printf("Could not write image %s\n", dump_image);
+        }
+    }
+
     nenv_del(e);
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Nitrogen);
+    nperf_close();
+    ntrace_cleanup();
+    nprofile_cleanup();
+    nimage_cleanup();
+    nreader_mpc_cleanup();
     deallocate_pools();
     return 0;
 }
@@ -0,0 +1,119 @@
+/*
+ *  Hardware performance counters through Linux perf_event_open.
+ *
+ *  Each counter is opened on its own for this process, counting user space
+ *  only, and read before and after what is measured. Counters the kernel or
+ *  the machine does not offer, such as inside most virtual machines or when
+ *  perf_event_paranoid forbids them, are left out. On other systems no
+ *  counter is ever available.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "nperf.h"
+
+bool nperf_loads = false;
+
+static const char* names[NPERF_COUNTERS] = {
+    "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+static bool opened = false;
+static int fds[NPERF_COUNTERS];
+static const char* unavailable = NULL;
+
+#ifdef __linux__
+static const unsigned long long configs[NPERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static void nperf_open(void) {
+    int error = 0;
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0) { error = errno; }
+    }
+
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        if (fds[i] >= 0) { return; }
+    }
+    unavailable = strerror(error);
+}
+#else
+static void nperf_open(void) {
+    for (int i = 0; i < NPERF_COUNTERS; i++) { fds[i] = -1; }
+    unavailable = "perf_event_open is only on Linux";
+}
+#endif
+
+static long long nperf_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Read every counter into c, marking those that could not be read */
+static void nperf_read(nperf_counts* c) {
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        long long value;
+        c->available[i] = fds[i] >= 0 && read(fds[i], &value, sizeof(value)) == sizeof(value);
+        c->values[i] = c->available[i] ? value : 0;
+    }
+}
+
+void nperf_begin(nperf_counts* c) {
+    if (!opened) {
+        nperf_open();
+        opened = true;
+    }
+    nperf_read(c);
+    c->time_ns = nperf_now();
+}
+
+void nperf_end(nperf_counts* c) {
+    long long end_ns = nperf_now();
+    nperf_counts end;
+    nperf_read(&end);
+
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        c->available[i] = c->available[i] && end.available[i];
+        c->values[i] = c->available[i] ? end.values[i] - c->values[i] : 0;
+    }
+    c->time_ns = end_ns - c->time_ns;
+}
+
+const char* nperf_unavailable(void) {
+    return unavailable;
+}
+
+const char* nperf_name(int counter) {
+    return names[counter];
+}
+
+void nperf_close(void) {
+    if (!opened) { return; }
+    for (int i = 0; i < NPERF_COUNTERS; i++) {
+        if (fds[i] >= 0) { close(fds[i]); }
+    }
+    opened = false;
+    unavailable = NULL;
+}
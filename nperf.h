@@ -0,0 +1,30 @@
+#ifndef nperf_h
+#define nperf_h
+#include <stdbool.h>
+
+/* Hardware counters, each of which may be unavailable */
+enum { NPERF_CYCLES, NPERF_INSTRUCTIONS, NPERF_CACHE_MISSES, NPERF_BRANCH_MISSES, NPERF_COUNTERS };
+
+/* Report counters for every file loaded, set by --perf */
+extern bool nperf_loads;
+
+typedef struct nperf_counts {
+    bool available[NPERF_COUNTERS];
+    long long values[NPERF_COUNTERS];
+    long long time_ns;
+} nperf_counts;
+
+/* Counters are opened the first time they are needed. Until then, or when
+ * the system has none, these measure time only */
+void nperf_begin(nperf_counts* c);
+void nperf_end(nperf_counts* c);
+
+/* Why no counters could be opened, or NULL if any were */
+const char* nperf_unavailable(void);
+
+/* Name of a counter, as used for map keys and in reports */
+const char* nperf_name(int counter);
+
+void nperf_close(void);
+
+#endif
@@ -0,0 +1,443 @@
+/*
+ *  Sampling profiler for Nitrogen functions.
+ *
+ *  nval_call keeps a stack of the names of the functions being called. While
+ *  the profiler runs, SIGPROF copies that stack into a ring buffer on a CPU
+ *  time interval. The ring is drained into counts of each distinct stack by
+ *  the next call after it fills past half way, and once more when the
+ *  profiler stops.
+ *
+ *  While it runs, every call is also counted and timed against the function,
+ *  told apart by its id and shown by its name. Exclusive time leaves out the calls a function makes, and
+ *  inclusive time of a recursive function is only counted by its outermost
+ *  call.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "ncore.h"
+#include "nprofile.h"
+
+/* Slots in the sample ring, each a name or NULL ending a sample */
+#define NPROFILE_RING (1 << 16)
+
+/* Names of the functions being called, outermost first, as far as the sampler looks */
+static const char* volatile call_stack[NPROFILE_MAX_DEPTH];
+static volatile int call_depth = 0;
+
+/* Every call being made, grown with the stack as the sampler never reads it */
+typedef struct nprofile_call {
+    const char* name;
+    /* Innermost user function at this depth, the call itself unless it is a builtin */
+    const char* function;
+    bool builtin;
+} nprofile_call;
+
+static nprofile_call* calls = NULL;
+static int call_capacity = 0;
+
+static const char** ring = NULL;
+static volatile long ring_head = 0;
+static volatile long ring_tail = 0;
+static volatile sig_atomic_t ring_pending = 0;
+static volatile long dropped = 0;
+
+static bool running = false;
+static struct sigaction old_action;
+
+/* Name shown for lambdas never bound to a name */
+static const char* anonymous = "lambda";
+
+/* Distinct stacks sampled and how many times each was seen */
+typedef struct nprofile_stack {
+    uint64_t hash;
+    int depth;
+    const char** frames;
+    long count;
+} nprofile_stack;
+
+static nprofile_stack* stacks = NULL;
+static int stack_count = 0;
+static int stack_capacity = 0;
+
+/* Calls and time in nanoseconds spent in one function */
+typedef struct nprofile_count {
+    long id;
+    const char* name;
+    long calls;
+    int64_t inclusive;
+    int64_t exclusive;
+    /* Calls that have not returned yet */
+    int active;
+} nprofile_count;
+
+static nprofile_count* counts = NULL;
+static int count_count = 0;
+static int count_capacity = 0;
+/* Index into counts plus one for each function id, open addressing twice the size of counts */
+static int* count_slots = NULL;
+
+/* A call being timed */
+typedef struct nprofile_frame {
+    int count;
+    int64_t start;
+    int64_t children;
+} nprofile_frame;
+
+static nprofile_frame* timed = NULL;
+static int timed_capacity = 0;
+/* Calls below this depth were made before the profiler started and are not timed */
+static int timed_base = 0;
+
+/* Interned names, open addressing with a power of two capacity */
+static char** names = NULL;
+static int name_count = 0;
+static int name_capacity = 0;
+
+static uint64_t nprofile_hash(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+char* nprofile_intern(const char* name) {
+    if (name_count * 2 >= name_capacity) {
+        int capacity = name_capacity ? name_capacity * 2 : 256;
+        char** grown = calloc(capacity, sizeof(char*));
+        for (int i = 0; i < name_capacity; i++) {
+            if (names[i] == NULL) { continue; }
+            uint64_t j = nprofile_hash(names[i], strlen(names[i])) & (capacity - 1);
+            while (grown[j]) { j = (j + 1) & (capacity - 1); }
+            grown[j] = names[i];
+        }
+        free(names);
+        names = grown;
+        name_capacity = capacity;
+    }
+
+    uint64_t i = nprofile_hash(name, strlen(name)) & (name_capacity - 1);
+    for (; names[i]; i = (i + 1) & (name_capacity - 1)) {
+        if (strcmp(names[i], name) == 0) { return names[i]; }
+    }
+    names[i] = strdup(name);
+    name_count++;
+    return names[i];
+}
+
+/* Count one more sample of a stack */
+static void nprofile_fold(const char** frames, int depth) {
+    if (stack_count * 2 >= stack_capacity) {
+        int capacity = stack_capacity ? stack_capacity * 2 : 256;
+        nprofile_stack* grown = calloc(capacity, sizeof(nprofile_stack));
+        for (int i = 0; i < stack_capacity; i++) {
+            if (stacks[i].frames == NULL) { continue; }
+            uint64_t j = stacks[i].hash & (capacity - 1);
+            while (grown[j].frames) { j = (j + 1) & (capacity - 1); }
+            grown[j] = stacks[i];
+        }
+        free(stacks);
+        stacks = grown;
+        stack_capacity = capacity;
+    }
+
+    uint64_t hash = nprofile_hash(frames, sizeof(char*) * depth);
+    uint64_t i = hash & (stack_capacity - 1);
+    for (; stacks[i].frames; i = (i + 1) & (stack_capacity - 1)) {
+        if (stacks[i].hash == hash && stacks[i].depth == depth
+            && memcmp(stacks[i].frames, frames, sizeof(char*) * depth) == 0) {
+            stacks[i].count++;
+            return;
+        }
+    }
+
+    /* Always allocate, so an empty stack is still marked as used */
+    stacks[i].frames = malloc(sizeof(char*) * depth + 1);
+    memcpy(stacks[i].frames, frames, sizeof(char*) * depth);
+    stacks[i].hash = hash;
+    stacks[i].depth = depth;
+    stacks[i].count = 1;
+    stack_count++;
+}
+
+/* Move complete samples out of the ring */
+static void nprofile_drain(void) {
+    ring_pending = 0;
+    long head = ring_head;
+    const char* frames[NPROFILE_MAX_DEPTH];
+    int depth = 0;
+
+    for (long i = ring_tail; i < head; i++) {
+        const char* name = ring[i % NPROFILE_RING];
+        if (name) {
+            frames[depth++] = name;
+            continue;
+        }
+        nprofile_fold(frames, depth);
+        depth = 0;
+        ring_tail = i + 1;
+    }
+}
+
+static int64_t nprofile_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t nprofile_id_slot(long id, int capacity) {
+    return nprofile_hash(&id, sizeof(id)) & (capacity - 1);
+}
+
+/* Counts for a function, added the first time it is called. Functions that
+ * share a name are counted apart, the name is only shown */
+static int nprofile_count_of(long id, const char* name) {
+    if (count_count == count_capacity) {
+        count_capacity = count_capacity ? count_capacity * 2 : 128;
+        counts = realloc(counts, sizeof(nprofile_count) * count_capacity);
+        free(count_slots);
+        count_slots = calloc(count_capacity * 2, sizeof(int));
+        for (int i = 0; i < count_count; i++) {
+            uint64_t j = nprofile_id_slot(counts[i].id, count_capacity * 2);
+            while (count_slots[j]) { j = (j + 1) & (count_capacity * 2 - 1); }
+            count_slots[j] = i + 1;
+        }
+    }
+
+    uint64_t j = nprofile_id_slot(id, count_capacity * 2);
+    for (; count_slots[j]; j = (j + 1) & (count_capacity * 2 - 1)) {
+        if (counts[count_slots[j] - 1].id == id) { return count_slots[j] - 1; }
+    }
+    nprofile_count* c = &counts[count_count];
+    c->id = id;
+    c->name = name;
+    c->calls = 0;
+    c->inclusive = 0;
+    c->exclusive = 0;
+    c->active = 0;
+    count_slots[j] = ++count_count;
+    return count_count - 1;
+}
+
+static void nprofile_time_enter(int depth, long id, const char* name) {
+    if (depth >= timed_capacity) {
+        timed_capacity = timed_capacity ? timed_capacity * 2 : 256;
+        timed = realloc(timed, sizeof(nprofile_frame) * timed_capacity);
+    }
+    nprofile_frame* frame = &timed[depth];
+    frame->count = nprofile_count_of(id, name);
+    frame->children = 0;
+    counts[frame->count].calls++;
+    counts[frame->count].active++;
+    frame->start = nprofile_now();
+}
+
+static void nprofile_time_exit(int depth) {
+    if (depth < timed_base) {
+        timed_base = depth;
+        return;
+    }
+    nprofile_frame* frame = &timed[depth];
+    int64_t elapsed = nprofile_now() - frame->start;
+    nprofile_count* c = &counts[frame->count];
+    c->exclusive += elapsed - frame->children;
+    if (--c->active == 0) { c->inclusive += elapsed; }
+    if (depth > timed_base) { timed[depth-1].children += elapsed; }
+}
+
+void nprofile_enter(nval* f) {
+    const char* name = f->name ? f->name : anonymous;
+    if (call_depth >= call_capacity) {
+        call_capacity = call_capacity ? call_capacity * 2 : 256;
+        calls = realloc(calls, sizeof(nprofile_call) * call_capacity);
+    }
+    nprofile_call* call = &calls[call_depth];
+    call->name = name;
+    call->builtin = f->builtin != NULL;
+    call->function = !call->builtin ? name : call_depth > 0 ? calls[call_depth-1].function : NULL;
+
+    if (call_depth < NPROFILE_MAX_DEPTH) { call_stack[call_depth] = name; }
+    if (running) { nprofile_time_enter(call_depth, f->id, name); }
+    /* The name is in place before the sampler can see it */
+    call_depth++;
+    if (ring_pending) { nprofile_drain(); }
+}
+
+void nprofile_exit(void) {
+    call_depth--;
+    if (running) { nprofile_time_exit(call_depth); }
+}
+
+void nprofile_current(const char** function, const char** builtin) {
+    if (call_depth == 0) {
+        *function = NULL;
+        *builtin = NULL;
+        return;
+    }
+    nprofile_call* call = &calls[call_depth-1];
+    *function = call->function;
+    *builtin = call->builtin ? call->name : NULL;
+}
+
+/* SIGPROF handler, copies the call stack into the ring if there is room */
+static void nprofile_sample(int sig) {
+    (void)sig;
+    int depth = call_depth < NPROFILE_MAX_DEPTH ? call_depth : NPROFILE_MAX_DEPTH;
+    long head = ring_head;
+
+    if (head + depth + 1 - ring_tail > NPROFILE_RING) {
+        dropped++;
+        ring_pending = 1;
+        return;
+    }
+    for (int i = 0; i < depth; i++) {
+        ring[(head + i) % NPROFILE_RING] = call_stack[i];
+    }
+    ring[(head + depth) % NPROFILE_RING] = NULL;
+    ring_head = head + depth + 1;
+
+    if (ring_head - ring_tail > NPROFILE_RING / 2) { ring_pending = 1; }
+}
+
+static bool nprofile_timer(long interval_us) {
+    struct itimerval t;
+    t.it_interval.tv_sec = interval_us / 1000000;
+    t.it_interval.tv_usec = interval_us % 1000000;
+    t.it_value = t.it_interval;
+    return setitimer(ITIMER_PROF, &t, NULL) == 0;
+}
+
+bool nprofile_start(long interval_us) {
+    if (running || interval_us <= 0) { return false; }
+
+    if (ring == NULL) { ring = malloc(sizeof(char*) * NPROFILE_RING); }
+    ring_head = 0;
+    ring_tail = 0;
+    ring_pending = 0;
+    dropped = 0;
+    count_count = 0;
+    if (count_slots) { memset(count_slots, 0, sizeof(int) * count_capacity * 2); }
+    timed_base = call_depth;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = nprofile_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &old_action) != 0) { return false; }
+
+    if (!nprofile_timer(interval_us)) {
+        sigaction(SIGPROF, &old_action, NULL);
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+bool nprofile_running(void) {
+    return running;
+}
+
+/* Stop the timer and forget the stacks counted so far */
+static void nprofile_halt(void) {
+    nprofile_timer(0);
+    sigaction(SIGPROF, &old_action, NULL);
+    running = false;
+
+    for (int i = 0; i < stack_capacity; i++) { free(stacks[i].frames); }
+    free(stacks);
+    stacks = NULL;
+    stack_count = 0;
+    stack_capacity = 0;
+}
+
+bool nprofile_stop(FILE* out) {
+    if (!running) { return false; }
+    nprofile_timer(0);
+    nprofile_drain();
+
+    for (int i = 0; i < stack_capacity; i++) {
+        nprofile_stack* s = &stacks[i];
+        if (s->frames == NULL) { continue; }
+        if (s->depth == 0) { fputs("toplevel", out); }
+        for (int j = 0; j < s->depth; j++) {
+            fprintf(out, "%s%s", j ? ";" : "", s->frames[j]);
+        }
+        fprintf(out, " %ld\n", s->count);
+    }
+    nprofile_halt();
+
+    if (dropped) {
+        fprintf(stderr, "Profiler dropped %ld samples while its buffer was full\n", dropped);
+    }
+    return fflush(out) == 0;
+}
+
+static int nprofile_by_exclusive(const void* a, const void* b) {
+    const nprofile_count* x = a;
+    const nprofile_count* y = b;
+    if (x->exclusive != y->exclusive) { return x->exclusive < y->exclusive ? 1 : -1; }
+    int order = strcmp(x->name, y->name);
+    return order ? order : x->id < y->id ? -1 : x->id > y->id;
+}
+
+bool nprofile_report(FILE* out, bool csv) {
+    nprofile_count* sorted = malloc(sizeof(nprofile_count) * (count_count + 1));
+    memcpy(sorted, counts, sizeof(nprofile_count) * count_count);
+    qsort(sorted, count_count, sizeof(nprofile_count), nprofile_by_exclusive);
+
+    int64_t total = 0;
+    for (int i = 0; i < count_count; i++) { total += sorted[i].exclusive; }
+
+    if (csv) {
+        fprintf(out, "function,calls,inclusive_ns,exclusive_ns\n");
+    } else {
+        fprintf(out, "%-24s %10s %14s %14s %7s\n", "function", "calls",
+            "inclusive ms", "exclusive ms", "self %");
+    }
+    for (int i = 0; i < count_count; i++) {
+        nprofile_count* c = &sorted[i];
+        if (csv) {
+            fprintf(out, "\"%s\",%ld,%lld,%lld\n", c->name, c->calls,
+                (long long)c->inclusive, (long long)c->exclusive);
+        } else {
+            fprintf(out, "%-24s %10ld %14.3f %14.3f %6.1f%%\n", c->name, c->calls,
+                c->inclusive / 1e6, c->exclusive / 1e6, total ? 100.0 * c->exclusive / total : 0.0);
+        }
+    }
+    free(sorted);
+    return fflush(out) == 0;
+}
+
+void nprofile_cleanup(void) {
+    if (running) { nprofile_halt(); }
+    free(ring);
+    ring = NULL;
+    free(counts);
+    counts = NULL;
+    free(count_slots);
+    count_slots = NULL;
+    count_count = 0;
+    count_capacity = 0;
+    free(timed);
+    timed = NULL;
+    timed_capacity = 0;
+    free(calls);
+    calls = NULL;
+    call_capacity = 0;
+    for (int i = 0; i < name_capacity; i++) { free(names[i]); }
+    free(names);
+    names = NULL;
+    name_count = 0;
+    name_capacity = 0;
+}
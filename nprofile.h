@@ -0,0 +1,38 @@
+#ifndef nprofile_h
+#define nprofile_h
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "ncore.h"
+
+/* Frames kept of the Nitrogen call stack, deeper calls are counted but not named */
+#define NPROFILE_MAX_DEPTH 1024
+
+/* Shared copy of a function name, kept until nprofile_cleanup. Copies of a
+ * function share its name, so names can be compared by address */
+char* nprofile_intern(const char* name);
+
+/* Called by nval_call around every function call */
+void nprofile_enter(nval* f);
+void nprofile_exit(void);
+
+/* Innermost user function being called and, if a builtin called by it is
+ * running, that builtin. Either is NULL when there is none */
+void nprofile_current(const char** function, const char** builtin);
+
+/* Sample the call stack every interval_us microseconds of CPU time, and
+ * count and time every call until the profiler is stopped */
+bool nprofile_start(long interval_us);
+bool nprofile_running(void);
+
+/* Stop sampling and write what was sampled as folded stacks, one
+ * "outer;inner;innermost count" line per distinct stack, for flame graphs */
+bool nprofile_stop(FILE* out);
+
+/* Calls, inclusive and exclusive time of each function called while the
+ * profiler last ran, most exclusive time first. As a table, or CSV with times in nanoseconds */
+bool nprofile_report(FILE* out, bool csv);
+
+void nprofile_cleanup(void);
+
+#endif
@@ -0,0 +1,489 @@
+/*
+ *  Readers turning Nitrogen source into nvals.
+ *
+ *  The mpc grammar builds an mpc_ast_t which nval_read converts. The
+ *  hand-written reader recognises the same tokens and builds nvals in a
+ *  single pass over the source with no intermediate tree.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mpc.h"
+#include "ncore.h"
+#include "nreader.h"
+
+bool nreader_use_mpc = false;
+bool nreader_stream = false;
+
+/* Kinds mpc gives the nodes of each rule, their place in the mpca_lang call */
+enum { NREAD_NUMBER = 1, NREAD_SYMBOL, NREAD_STRING, NREAD_COMMENT,
+       NREAD_SEXPR, NREAD_QEXPR, NREAD_EXPR, NREAD_NITROGEN };
+
+mpc_parser_t* Number;
+mpc_parser_t* Symbol;
+mpc_parser_t* String;
+mpc_parser_t* Comment;
+mpc_parser_t* Sexpr;
+mpc_parser_t* Qexpr;
+mpc_parser_t* Expr;
+mpc_parser_t* Nitrogen;
+
+void nreader_mpc_init(void) {
+    /* Setup MPC parsers */
+    Number    = mpc_new("number");
+    Symbol    = mpc_new("symbol");
+    String    = mpc_new("string");
+    Comment   = mpc_new("comment");
+    Sexpr     = mpc_new("sexpr");
+    Qexpr     = mpc_new("qexpr");
+    Expr      = mpc_new("expr");
+    Nitrogen  = mpc_new("nitrogen");
+
+    /* Define parsers. Each token rule compiles to a DFA, which consumes
+     * nothing when it fails, so an expr is decided by its first character
+     * and the grammar can be parsed without backtracking */
+    mpca_lang(MPCA_LANG_PREDICTIVE,
+        "                                                                       \
+          number    : /-?[.|0-9]+/ ;                                            \
+          symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;                       \
+          string    : /\"(\\\\.|[^\"\\\\])*\"/ ;                                \
+          comment   : /[;#][^\\r\\n]*/ ;                                        \
+          sexpr     : '(' <expr>* ')' ;                                         \
+          qexpr     : '{' <expr>* '}' ;                                         \
+          expr      : <number> | <symbol> | <sexpr>                             \
+                    | <qexpr>  | <string> | <comment> ;                         \
+          nitrogen  : /^/ <expr>* /$/ ;                                         \
+        ",
+        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Nitrogen);
+}
+
+void nreader_mpc_cleanup(void) {
+    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Nitrogen);
+}
+
+static nval* nval_read_number(const char* s) {
+    errno = 0;
+    if (strstr(s, ".")) {
+        double x = strtod(s, NULL);
+        return errno != ERANGE ? nval_double(x) : nval_err("invalid number");
+    } else {
+        long x = strtol(s, NULL, 10);
+        return errno != ERANGE ? nval_num(x) : nval_err("invalid number");
+    }
+}
+
+nval* nval_read_num(mpc_ast_t* t) {
+    return nval_read_number(t->contents);
+}
+
+nval* nval_read_str(mpc_ast_t* t) {
+    t->contents[strlen(t->contents)-1] = '\0';
+    char* unescaped = malloc(strlen(t->contents+1)+1);
+    strcpy(unescaped, t->contents+1);
+    unescaped = mpcf_unescape(unescaped);
+    nval* str = nval_str(unescaped);
+    free(unescaped);
+    return str;
+}
+
+nval* nval_read(mpc_ast_t* t) {
+    nval* x;
+    switch (t->kind) {
+        case NREAD_NUMBER: return nval_read_num(t);
+        case NREAD_SYMBOL: return nval_sym(t->contents);
+        case NREAD_STRING: return nval_read_str(t);
+        case NREAD_QEXPR: x = nval_qexpr(); break;
+        /* S-Expressions and the root */
+        default: x = nval_sexpr(); break;
+    }
+
+    /* Fill this list with any valid expression contained within,
+     * brackets, comments and the start and end of input have other kinds */
+    for (int i = 0; i < t->children_num; i++) {
+        switch (t->children[i]->kind) {
+            case NREAD_NUMBER:
+            case NREAD_SYMBOL:
+            case NREAD_STRING:
+            case NREAD_SEXPR:
+            case NREAD_QEXPR:
+                x = nval_add(x, nval_read(t->children[i]));
+                break;
+        }
+    }
+
+    return x;
+}
+
+/* Map a regular file into memory. False if it cannot be mapped */
+bool nfile_map(nfile* f, const char* filename) {
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) { return false; }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+            close(fd);
+            f->src = p;
+            f->len = st.st_size;
+            f->mapped = true;
+            f->released = 0;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    return false;
+}
+
+/* Map a regular file into memory, or read it into a buffer if it cannot be mapped */
+bool nfile_open(nfile* f, const char* filename) {
+    if (nfile_map(f, filename)) { return true; }
+
+    /* Pipes, empty files and platforms without mmap */
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) { return false; }
+
+    long size = 4096;
+    long len = 0;
+    char* src = malloc(size);
+    while (1) {
+        len += fread(src + len, 1, size - len, fp);
+        if (len < size) { break; }
+        size *= 2;
+        src = realloc(src, size);
+    }
+
+    if (ferror(fp)) {
+        fclose(fp);
+        free(src);
+        return false;
+    }
+    fclose(fp);
+
+    f->src = src;
+    f->len = len;
+    f->mapped = false;
+    f->released = 0;
+    return true;
+}
+
+/* Let the kernel drop mapped pages before upto, they will not be read again */
+void nfile_release(nfile* f, long upto) {
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+    long page = sysconf(_SC_PAGESIZE);
+    upto -= upto % page;
+    if (f->mapped && upto > f->released) {
+        madvise((char*)f->src + f->released, upto - f->released, MADV_DONTNEED);
+        f->released = upto;
+    }
+#else
+    (void)f;
+    (void)upto;
+#endif
+}
+
+void nfile_close(nfile* f) {
+#ifndef _WIN32
+    if (f->mapped) {
+        munmap((void*)f->src, f->len);
+        return;
+    }
+#endif
+    free((void*)f->src);
+}
+
+/* Hand-written reader
+ *
+ * Lists that are still open are kept on an explicit stack rather than the C
+ * stack, so a reader can stop wherever its text runs out and carry on when
+ * more is fed to it. Tokens that reach the end of the text before the end of
+ * input are left unread until the rest of them arrives.
+ */
+
+static bool nreader_is_digit(char c) {
+    return (c >= '0' && c <= '9') || c == '.' || c == '|';
+}
+
+static bool nreader_is_symbol(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || (c != '\0' && strchr("_+-*/\\=<>!&%", c));
+}
+
+static bool nreader_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/* Advance line and col over n characters of s */
+static void nreader_count_lines(const char* s, long n, int* line, int* col) {
+    for (long i = 0; i < n; i++) {
+        if (s[i] == '\n') { (*line)++; *col = 1; }
+        else { (*col)++; }
+    }
+}
+
+/* Syntax error at the reader's position, formatted like mpc's "name:line:col: error: msg" */
+static nval* nreader_error(nreader* r, char* msg) {
+    r->failed = true;
+    int line = r->line;
+    int col = r->col;
+    nreader_count_lines(r->src, r->pos, &line, &col);
+    return nval_err("%s:%i:%i: error: %s", r->name, line, col, msg);
+}
+
+/* Skip whitespace and comments. False if a comment runs into the end of the text */
+static bool nreader_skip(nreader* r) {
+    while (r->pos < r->len) {
+        char c = r->src[r->pos];
+        if (nreader_is_space(c)) {
+            r->pos++;
+        } else if (c == ';' || c == '#') {
+            long end = r->pos;
+            while (end < r->len && r->src[end] != '\n' && r->src[end] != '\r') { end++; }
+            if (end == r->len && !r->eof) { return false; }
+            r->pos = end;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+/* Copy of src[start, end) as a string, in buf if it fits */
+static char* nreader_token(nreader* r, long start, long end, char* buf, long size) {
+    long n = end - start;
+    char* s = n < size ? buf : malloc(n + 1);
+    memcpy(s, r->src + start, n);
+    s[n] = '\0';
+    return s;
+}
+
+/* Number or symbol, NULL if it may continue past the end of the text */
+static nval* nreader_atom(nreader* r, bool number) {
+    char buf[128];
+    long end = r->pos;
+
+    if (number) {
+        if (r->src[end] == '-') { end++; }
+        while (end < r->len && nreader_is_digit(r->src[end])) { end++; }
+    } else {
+        while (end < r->len && nreader_is_symbol(r->src[end])) { end++; }
+    }
+    if (end == r->len && !r->eof) { return NULL; }
+
+    char* s = nreader_token(r, r->pos, end, buf, sizeof(buf));
+    nval* x = number ? nval_read_number(s) : nval_sym(s);
+    if (s != buf) { free(s); }
+    r->pos = end;
+    return x;
+}
+
+/* String literal, NULL if its closing quote has not been read yet */
+static nval* nreader_string(nreader* r) {
+    static const char escapes[] = "abfnrtv\\'\"0";
+    static const char unescaped[] = "\a\b\f\n\r\t\v\\'\"\0";
+
+    long start = r->pos + 1;
+    long end = start;
+    while (end < r->len && r->src[end] != '"') {
+        if (r->src[end] == '\\' && end + 1 < r->len) { end++; }
+        end++;
+    }
+    if (end >= r->len) {
+        return r->eof ? nreader_error(r, "unterminated string") : NULL;
+    }
+
+    /* Unescape the same sequences as mpcf_unescape, leaving others as they are */
+    char* s = malloc(end - start + 1);
+    long n = 0;
+    for (long i = start; i < end; i++) {
+        char c = r->src[i];
+        char* esc = (c == '\\') ? strchr(escapes, r->src[i+1]) : NULL;
+        if (esc && r->src[i+1] != '\0') {
+            s[n++] = unescaped[esc - escapes];
+            i++;
+        } else {
+            s[n++] = c;
+        }
+    }
+    s[n] = '\0';
+    r->pos = end + 1;
+
+    nval* x = nval_str(s);
+    free(s);
+    return x;
+}
+
+static void nreader_push(nreader* r, nval* x) {
+    if (r->depth == r->open_size) {
+        r->open_size = r->open_size ? r->open_size * 2 : 16;
+        r->open = realloc(r->open, sizeof(nval*) * r->open_size);
+    }
+    r->open[r->depth++] = x;
+    r->pos++;
+}
+
+/* Drop lists left open by an error or by input that stopped part way */
+static void nreader_drop_open(nreader* r) {
+    while (r->depth > 0) { nval_del(r->open[--r->depth]); }
+}
+
+static void nreader_init(nreader* r, const char* name) {
+    r->name = name;
+    r->src = NULL;
+    r->len = 0;
+    r->pos = 0;
+    r->eof = false;
+    r->failed = false;
+    r->line = 1;
+    r->col = 1;
+    r->buf = NULL;
+    r->buf_size = 0;
+    r->open = NULL;
+    r->depth = 0;
+    r->open_size = 0;
+}
+
+/* Read the whole of src, which stays owned by the caller */
+void nreader_open(nreader* r, const char* name, const char* src, long len) {
+    nreader_init(r, name);
+    r->src = src;
+    r->len = len;
+    r->eof = true;
+}
+
+/* Read text handed over a piece at a time with nreader_feed */
+void nreader_open_stream(nreader* r, const char* name) {
+    nreader_init(r, name);
+}
+
+void nreader_feed(nreader* r, const char* text, long len) {
+    /* Discard what has been read, keeping count of the lines it held */
+    if (r->pos > 0) {
+        nreader_count_lines(r->buf, r->pos, &r->line, &r->col);
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len + len > r->buf_size) {
+        while (r->len + len > r->buf_size) {
+            r->buf_size = r->buf_size ? r->buf_size * 2 : 4096;
+        }
+        r->buf = realloc(r->buf, r->buf_size);
+    }
+    memcpy(r->buf + r->len, text, len);
+    r->len += len;
+    r->src = r->buf;
+}
+
+/* No more text will be fed, so tokens at the end of it are complete */
+void nreader_finish(nreader* r) {
+    r->eof = true;
+}
+
+/* True while a partly read expression is waiting for more text */
+bool nreader_pending(nreader* r) {
+    if (r->failed) { return false; }
+    if (r->depth > 0) { return true; }
+    nreader_skip(r);
+    return r->pos < r->len;
+}
+
+/* Forget a partly read expression, and any error */
+void nreader_reset(nreader* r) {
+    nreader_drop_open(r);
+    r->pos = r->len;
+    r->failed = false;
+}
+
+void nreader_close(nreader* r) {
+    nreader_drop_open(r);
+    free(r->open);
+    free(r->buf);
+}
+
+/* Next top level expression. NULL at the end of the text, an error on a syntax error */
+nval* nreader_next(nreader* r) {
+    if (r->failed) { return NULL; }
+
+    while (1) {
+        if (!nreader_skip(r)) { return NULL; }
+
+        if (r->pos >= r->len) {
+            if (r->eof && r->depth > 0) {
+                int type = r->open[r->depth-1]->type;
+                nreader_drop_open(r);
+                return nreader_error(r, type == NVAL_SEXPR ? "expected ')'" : "expected '}'");
+            }
+            return NULL;
+        }
+
+        char c = r->src[r->pos];
+        char n = r->pos + 1 < r->len ? r->src[r->pos+1] : '\0';
+        nval* x = NULL;
+
+        if (c == '(') { nreader_push(r, nval_sexpr()); continue; }
+        if (c == '{') { nreader_push(r, nval_qexpr()); continue; }
+
+        if ((c == ')' || c == '}') && r->depth > 0
+            && r->open[r->depth-1]->type == (c == ')' ? NVAL_SEXPR : NVAL_QEXPR)) {
+            r->pos++;
+            x = r->open[--r->depth];
+        } else if (c == '-' && r->pos + 1 == r->len && !r->eof) {
+            /* Could be a number or a symbol, depending on what follows */
+            return NULL;
+        } else if (nreader_is_digit(c) || (c == '-' && nreader_is_digit(n))) {
+            x = nreader_atom(r, true);
+        } else if (nreader_is_symbol(c)) {
+            x = nreader_atom(r, false);
+        } else if (c == '"') {
+            x = nreader_string(r);
+        } else {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "unexpected '%c'", c);
+            nreader_drop_open(r);
+            return nreader_error(r, msg);
+        }
+
+        if (x == NULL) { return NULL; }
+        if (r->failed) {
+            nreader_drop_open(r);
+            return x;
+        }
+
+        if (r->depth == 0) { return x; }
+        nval_add(r->open[r->depth-1], x);
+    }
+}
+
+/* Read all of src into an S-Expression, like nval_read on the mpc root */
+nval* nval_read_source(const char* name, const char* src, long len) {
+    nreader r;
+    nreader_open(&r, name, src, len);
+
+    nval* x = nval_sexpr();
+    nval* y;
+    while ((y = nreader_next(&r))) {
+        if (r.failed) {
+            nval_del(x);
+            x = y;
+            break;
+        }
+        x = nval_add(x, y);
+    }
+    nreader_close(&r);
+    return x;
+}
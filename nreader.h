@@ -0,0 +1,63 @@
+#ifndef nreader_h
+#define nreader_h
+#include <stdbool.h>
+
+#include "mpc.h"
+#include "ncore.h"
+
+/* Use the mpc grammar instead of the hand-written reader */
+extern bool nreader_use_mpc;
+
+/* Have load evaluate each top level expression as soon as it is read */
+extern bool nreader_stream;
+
+/* mpc grammar for Nitrogen */
+extern mpc_parser_t* Nitrogen;
+void nreader_mpc_init(void);
+void nreader_mpc_cleanup(void);
+nval* nval_read(mpc_ast_t* t);
+
+/* Hand-written reader, builds nvals straight from source text */
+typedef struct nreader {
+    const char* name;
+    const char* src;
+    long len;
+    long pos;
+    bool eof;
+    bool failed;
+    /* Line and column of src[0], once earlier text has been discarded */
+    int line;
+    int col;
+    /* Text fed in pieces, owned by the reader */
+    char* buf;
+    long buf_size;
+    /* Lists that have been opened but not yet closed */
+    nval** open;
+    int depth;
+    int open_size;
+} nreader;
+
+/* Contents of a source file, memory mapped where the platform allows */
+typedef struct nfile {
+    const char* src;
+    long len;
+    bool mapped;
+    long released;
+} nfile;
+
+bool nfile_map(nfile* f, const char* filename);
+bool nfile_open(nfile* f, const char* filename);
+void nfile_release(nfile* f, long upto);
+void nfile_close(nfile* f);
+
+void nreader_open(nreader* r, const char* name, const char* src, long len);
+void nreader_open_stream(nreader* r, const char* name);
+void nreader_feed(nreader* r, const char* text, long len);
+void nreader_finish(nreader* r);
+bool nreader_pending(nreader* r);
+void nreader_reset(nreader* r);
+void nreader_close(nreader* r);
+nval* nreader_next(nreader* r);
+nval* nval_read_source(const char* name, const char* src, long len);
+
+#endif
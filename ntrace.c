@@ -0,0 +1,124 @@
+/*
+ *  Execution tracing.
+ *
+ *  While tracing, calls, file loads and the top-level forms of loaded files
+ *  record a begin and an end event with a timestamp into a ring buffer.
+ *  Only the newest events are kept once the ring is full, so the trace is
+ *  written without any end events whose begin was overwritten.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "ntrace.h"
+
+typedef struct ntrace_event {
+    int64_t ts;
+    const char* name;
+    char kind;
+    /* 'B' for begin or 'E' for end, as in the trace-event format */
+    char phase;
+} ntrace_event;
+
+bool ntrace_on = false;
+
+static ntrace_event* events = NULL;
+static long capacity = 0;
+/* Events recorded since the trace started, the ring holds the last capacity of them */
+static long recorded = 0;
+static int64_t started = 0;
+
+static const char* kind_names[] = { "call", "load", "form" };
+
+static int64_t ntrace_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+bool ntrace_start(long n) {
+    if (n <= 0) { return false; }
+    if (n != capacity) {
+        free(events);
+        events = malloc(sizeof(ntrace_event) * n);
+        if (events == NULL) {
+            capacity = 0;
+            return false;
+        }
+        capacity = n;
+    }
+    recorded = 0;
+    started = ntrace_now();
+    ntrace_on = true;
+    return true;
+}
+
+void ntrace_stop(void) {
+    ntrace_on = false;
+}
+
+static void ntrace_event_add(int kind, const char* name, char phase) {
+    ntrace_event* ev = &events[recorded % capacity];
+    ev->ts = ntrace_now() - started;
+    ev->name = name;
+    ev->kind = kind;
+    ev->phase = phase;
+    recorded++;
+}
+
+void ntrace_begin(int kind, const char* name) {
+    ntrace_event_add(kind, name, 'B');
+}
+
+void ntrace_end(int kind, const char* name) {
+    ntrace_event_add(kind, name, 'E');
+}
+
+static void ntrace_put_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+bool ntrace_write(FILE* out) {
+    long first = recorded > capacity ? recorded - capacity : 0;
+    long open = 0;
+    bool comma = false;
+
+    fputs("{\"traceEvents\":[", out);
+    for (long i = first; i < recorded; i++) {
+        ntrace_event* ev = &events[i % capacity];
+        /* The begin of this one was overwritten */
+        if (ev->phase == 'E' && open == 0) { continue; }
+        open += ev->phase == 'B' ? 1 : -1;
+
+        fputs(comma ? ",\n" : "\n", out);
+        comma = true;
+        fputs("{\"name\":", out);
+        ntrace_put_string(out, ev->name);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+            kind_names[(int)ev->kind], ev->phase, ev->ts / 1e3);
+    }
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", out);
+    return fflush(out) == 0;
+}
+
+void ntrace_cleanup(void) {
+    ntrace_on = false;
+    free(events);
+    events = NULL;
+    capacity = 0;
+    recorded = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef ntrace_h
+#define ntrace_h
+#include <stdio.h>
+#include <stdbool.h>
+
+/* What an event is the start or end of */
+enum { NTRACE_CALL, NTRACE_LOAD, NTRACE_FORM };
+
+/* Set while tracing, checked before calling into the tracer */
+extern bool ntrace_on;
+
+/* Record events into a ring of the given number of events, the oldest
+ * being overwritten once it is full */
+bool ntrace_start(long capacity);
+void ntrace_stop(void);
+
+/* Names must stay valid until the trace is written, use nprofile_intern */
+void ntrace_begin(int kind, const char* name);
+void ntrace_end(int kind, const char* name);
+
+/* Events in the ring as Chrome trace-event JSON, for chrome://tracing or Perfetto */
+bool ntrace_write(FILE* out);
+
+void ntrace_cleanup(void);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ *  Turns a Nitrogen source file into C source holding a module image of
+ *  its forms, so the file can be linked into the interpreter.
+ *
+ *  Usage: nembed source name output.c
+ *
+ *  The output defines `const unsigned char name[]` and `const long name_size`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ncore.h"
+#include "nreader.h"
+#include "nimage.h"
+#include "mempool.h"
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s source name output.c\n", argv[0]);
+        return 1;
+    }
+
+    nfile f;
+    if (!nfile_open(&f, argv[1])) {
+        fprintf(stderr, "%s: error: Unable to open file!\n", argv[1]);
+        return 1;
+    }
+
+    nval* forms = nval_read_source(argv[1], f.src, f.len);
+    if (forms->type == NVAL_ERR) {
+        fprintf(stderr, "%s\n", forms->err);
+        nval_del(forms);
+        nfile_close(&f);
+        deallocate_pools();
+        return 1;
+    }
+
+    long size = 0;
+    unsigned char* data = nimage_module(forms, f.len, nimage_hash(f.src, f.len), &size);
+    nval_del(forms);
+    nfile_close(&f);
+    deallocate_pools();
+
+    FILE* fp = data ? fopen(argv[3], "w") : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "%s: error: Unable to write image!\n", argv[3]);
+        free(data);
+        return 1;
+    }
+
+    fprintf(fp, "/* Generated from %s by tools/nembed, do not edit */\n", argv[1]);
+    fprintf(fp, "const unsigned char %s[] = {", argv[2]);
+    for (long i = 0; i < size; i++) {
+        fprintf(fp, "%s0x%02x,", i % 12 ? " " : "\n    ", data[i]);
+    }
+    fprintf(fp, "\n};\nconst long %s_size = %ld;\n", argv[2], size);
+    free(data);
+
+    if (fclose(fp) != 0) {
+        remove(argv[3]);
+        return 1;
+    }
+    return 0;
+}